@@ -7,9 +7,13 @@
 
 #pragma once
 #include <uSnippets/object.hpp>
+#include <uSnippets/log.hpp>
 #include <uSnippets/serializer.hpp>
+#include <uSnippets/gzip.hpp>
+#include <uSnippets/lz4.hpp>
 
 #include <boost/noncopyable.hpp>
+#include <zlib.h>
 
 #include <fstream>
 #include <list>
@@ -17,34 +21,68 @@
 #include <unordered_map>
 
 #include <mutex>
+#include <thread>
+#include <future>
 #include <limits>
 
 namespace uSnippets {
 class GenericCache : private boost::noncopyable {
+public:
+	enum Codec { RAW, GZIP, LZ4 };
 
+private:
 	typedef std::lock_guard<std::recursive_mutex> Lock;
 	std::recursive_mutex m;
 	std::string filename;
 	std::fstream file;
+	Codec codec; // Default codec for new chunks
+	bool verifyReads = false; // Check the payload checksum on every get
 		
 	struct Chunk {
 
 		std::string key;
 		uint64_t count;
-		size_t dataSize;
+		size_t dataSize; // Size of the data as stored on disk (i.e., after compression)
+		uint8_t codec;
+		uint32_t checksum; // CRC32 of the data as stored on disk
 		
 		size_t size;
 		size_t pos;
 		size_t dataPos;
 		std::multimap<size_t, std::list<Chunk>::iterator>::iterator holeIt; // Hole BEFORE the actual chunk
 		
-		template<class Archive> void serialize(Archive &ar, const uint) { ar & key & count & dataSize; }
+		template<class Archive> void serialize(Archive &ar, const uint) { ar & key & count & dataSize & codec & checksum; }
 	};
 	
 	std::list<Chunk> chunks; //All chunks sorted by disk state
-	std::unordered_map<std::string, std::list<Chunk>::iterator> index; //Dictionary from the name to the valid chunk
+	std::map<std::string, std::list<Chunk>::iterator> index; //Dictionary from the name to the valid chunk, sorted by name
 	std::multimap<size_t, std::list<Chunk>::iterator> holes; //All holes and its related chunk (the hole is before the chunk)
 
+	struct Prefetched { uint8_t codec; std::string data; std::list<std::string>::iterator age; };
+	std::unordered_map<std::string, Prefetched> prefetched; //Payloads read ahead (still encoded), consumed by the next get
+	std::list<std::string> prefetchAge; //Prefetched keys, oldest first
+	size_t prefetchedBytes = 0, prefetchLimit = size_t(1)<<28; //Beyond the limit the oldest payloads are dropped
+	std::list<std::future<void>> pending; //Running prefetches
+
+	void dropPrefetched(const std::string &key) {
+
+		Lock lock(m);
+		auto it = prefetched.find(key);
+		if (it == prefetched.end()) return;
+		prefetchedBytes -= it->second.data.size();
+		prefetchAge.erase(it->second.age);
+		prefetched.erase(it);
+	}
+
+	void keepPrefetched(const std::string &key, uint8_t codec, std::string &&data) {
+
+		Lock lock(m);
+		if (prefetched.count(key) or data.size()>prefetchLimit) return;
+		while (prefetchedBytes+data.size()>prefetchLimit) dropPrefetched(prefetchAge.front());
+		prefetchedBytes += data.size();
+		prefetched.emplace(key, Prefetched{codec, std::move(data), prefetchAge.insert(prefetchAge.end(), key)});
+	}
+
 	void updateHole(std::list<Chunk>::iterator it) { // Update the hole between this chunk and the previous one.
 
 		Lock lock(m); 
@@ -61,6 +99,7 @@ class GenericCache : private boost::noncopyable {
 	uint64_t freeAndGetCount(const std::string &key) {
 
 		Lock lock(m); 
+		dropPrefetched(key);
 		auto count = 0;
 		auto indexIt = index.find(key);
 		if (indexIt != index.end()) {
@@ -74,8 +113,41 @@ class GenericCache : private boost::noncopyable {
 		return count;
 	}
 	
-	bool getRAW(const std::string &key, std::string &sdata) { 
+	static uint32_t crc(const char *data, size_t size) {
 		
+		uLong c = crc32(0L, Z_NULL, 0);
+		for (size_t done=0; done<size; done+=(1<<30))
+			c = crc32(c, (const Bytef *)data+done, std::min(size-done, size_t(1<<30)));
+		return c;
+	}
+
+	static std::string encode(const std::string &sdata, Codec c) {
+		
+		if (c==GZIP) return Codecs::GZip::code(sdata);
+		if (c==LZ4)  return Codecs::LZ4::encode(sdata);
+		return sdata;
+	}
+
+	static std::string decode(const std::string &sdata, uint8_t c) {
+		
+		if (c==GZIP) return Codecs::GZip::decode(sdata);
+		if (c==LZ4)  return Codecs::LZ4::decode(sdata);
+		return sdata;
+	}
+
+	bool getEncoded(const std::string &key, std::string &sdata, uint8_t &chunkCodec) { 
+
+		Lock lock(m);
+		auto prefetchedIt = prefetched.find(key);
+		if (prefetchedIt != prefetched.end()) {
+			chunkCodec = prefetchedIt->second.codec;
+			sdata.swap(prefetchedIt->second.data);
+			prefetchedBytes -= sdata.size();
+			prefetchAge.erase(prefetchedIt->second.age);
+			prefetched.erase(prefetchedIt);
+			return true;
+		}
+
 		if (not file.is_open()) return false; 
 		
 		auto indexIt = index.find(key);
@@ -83,15 +155,60 @@ class GenericCache : private boost::noncopyable {
 		Chunk &chunk = *indexIt->second;
 		
 		sdata.resize(chunk.dataSize);
+		chunkCodec = chunk.codec;
 //		file.sync(); 
-		Lock lock(m);		
 		file.seekg(chunk.dataPos);		
 		file.read(&sdata[0], sdata.size());
+		if (verifyReads and crc(sdata.data(), sdata.size())!=chunk.checksum) {
+			Log(2) << "GenericCache: wrong checksum for key " << key << " in " << filename;
+			return false;
+		}
 		return true;
 	}
 
-	void setRAW(const std::string &key, const std::string &sdata) { 
+	bool getRAW(const std::string &key, std::string &sdata) { 
 		
+		uint8_t chunkCodec;
+		if (not getEncoded(key, sdata, chunkCodec)) return false;
+		if (chunkCodec!=RAW) sdata = decode(sdata, chunkCodec); // decompress outside the lock
+		return true;
+	}
+
+	bool nextKey(const std::string &from, bool inclusive, std::string &key) { // First key >= (or >) from
+
+		Lock lock(m);
+		auto indexIt = (inclusive ? index.lower_bound(from) : index.upper_bound(from));
+		if (indexIt == index.end()) return false;
+		key = indexIt->first;
+		return true;
+	}
+
+	std::vector<std::string> sortByDisk(const std::vector<std::string> &keys) { // Drops unknown and repeated keys
+		
+		Lock lock(m);
+		std::vector<std::pair<size_t, std::string>> sorted;
+		for (auto &key : keys) {
+			auto indexIt = index.find(key);
+			if (indexIt != index.end()) sorted.emplace_back(indexIt->second->dataPos, key);
+		}
+		std::sort(sorted.begin(), sorted.end());
+		sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+		
+		std::vector<std::string> ret;
+		for (auto &s : sorted) ret.push_back(std::move(s.second));
+		return ret;
+	}
+
+	void setRAW(const std::string &key, const std::string &rdata, Codec c) { 
+		
+		// Compress before locking, and fall back to RAW if it does not pay off or the codec can not take the whole chunk.
+		if (c==LZ4  and rdata.size()>LZ4_MAX_INPUT_SIZE) c = RAW;
+		if (c==GZIP and rdata.size()>std::numeric_limits<uInt>::max()) c = RAW; // z_stream counts in 32 bits
+		std::string cdata;
+		if (c!=RAW) cdata = encode(rdata, c);
+		if (c!=RAW and cdata.size()>=rdata.size()) c = RAW;
+		const std::string &sdata = (c==RAW?rdata:cdata);
+
 		Lock lock(m);
 		if (not file.is_open()) return; 
 
@@ -103,6 +220,8 @@ class GenericCache : private boost::noncopyable {
 		chunk.key = key;
 		chunk.count = count+1;
 		chunk.dataSize = sdata.size();
+		chunk.codec = c;
+		chunk.checksum = crc(sdata.data(), sdata.size());
 		chunk.holeIt = holes.end();
 		
 		std::string sheader = Serializer::serialize(chunk);
@@ -156,24 +275,37 @@ class GenericCache : private boost::noncopyable {
 			file.seekg (-1, file.end);
 			if (file.get()!='#') return false;
 			file.seekg (-20, file.end);
-			size_t pos=0;
+			size_t pos=0, end=file.tellg();
 			for (int i=0; i<19; i++) pos = pos*10+file.get()-'0';
 			file.sync(); 
 			file.seekg(pos);
 			
+			// The index is only trusted if its checksum matches, otherwise the caller rebuilds it from the chunks
+			uint64_t size=0;
+			uint32_t checksum=0;
+			if (pos>end or not Serializer::unserialize(file, size) or not Serializer::unserialize(file, checksum) or size>end-pos) { file.clear(); return false; }
+			std::string sindex(size, '\0');
+			file.read(&sindex[0], size);
+			if (uint64_t(file.gcount())!=size or crc(sindex.data(), size)!=checksum) { 
+				file.clear(); 
+				Log(2) << "GenericCache: damaged index in " << filename << ", rebuilding";
+				return false; 
+			}
+			
+			Serializer::SpanBuf sb(sindex.c_str(), sindex.size());
+			std::istream is(&sb);
 			uint64_t nChunks=0;
-			Serializer::unserialize(file, nChunks);
-			for (uint64_t i=0; i<nChunks; i++) {
+			bool ok = Serializer::unserialize(is, nChunks);
+			for (uint64_t i=0; ok and i<nChunks; i++) {
 				Chunk chunk;
-				Serializer::unserialize(file, chunk);
-				Serializer::unserialize(file, chunk.pos);
-				Serializer::unserialize(file, chunk.size);
+				ok = Serializer::unserialize(is, chunk) and Serializer::unserialize(is, chunk.pos) and Serializer::unserialize(is, chunk.size);
 				chunk.holeIt = holes.end();
 				chunk.dataPos = chunk.pos + (chunk.size - chunk.dataSize - 1);
-				index.emplace(chunk.key, chunks.insert(chunks.end(), chunk));
+				if (ok) index.emplace(chunk.key, chunks.insert(chunks.end(), chunk));
 			}
+			if (not ok) { index.clear(); chunks.clear(); return false; }
 			for (auto it = chunks.begin(); it!=chunks.end(); it++) updateHole(it);
-		} catch (std::istream::failure) { file.clear(); return false; }
+		} catch (std::istream::failure) { file.clear(); index.clear(); chunks.clear(); holes.clear(); return false; }
 		return true;
 	}
 	
@@ -190,7 +322,7 @@ class GenericCache : private boost::noncopyable {
 				sindex += Serializer::serialize(chunk.pos);
 				sindex += Serializer::serialize(chunk.size);
 			}
-			setRAW("__index", sindex);
+			setRAW("__index", Serializer::serialize(uint64_t(sindex.size())) + Serializer::serialize(crc(sindex.data(), sindex.size())) + sindex, RAW);
 			
 			size_t pos = index["__index"]->dataPos;
 			
@@ -211,7 +343,7 @@ public:
 
 	GenericCache(      GenericCache &&) = default; GenericCache& operator=(      GenericCache &&) = default;
 
-	GenericCache(std::string filename) : filename(filename) {
+	GenericCache(std::string filename, Codec codec = RAW) : filename(filename), codec(codec) {
 				
 		Lock lock(m);
 		
@@ -241,6 +373,8 @@ public:
 			file.seekg(chunk.pos+chunk.size-1);
 			file.ignore(std::numeric_limits<std::streamsize>::max(),'\n');
 			
+			if (chunk.key=="__index") continue; // a stale index, its space becomes a hole
+			
 			auto found = index.find(chunk.key);
 			if (found==index.end()) {
 				index.emplace(chunk.key, chunks.insert(chunks.end(), chunk));
@@ -256,6 +390,7 @@ public:
 	}
 	
 	virtual ~GenericCache() { 
+		for (auto &f : pending) f.wait();
 		if (not indexed)
 			indexed = writeIndex();
 	}
@@ -265,10 +400,49 @@ public:
 
 	bool get(const std::string &key, std::string &str) { return getRAW(key, str); }
 
+	// Like get, but cv::Mat_ and std::string_view fields point into the read buffer (see Serializer::unserializeView)
+	template<class T>
+	std::shared_ptr<const T> getView(const std::string &key) { auto str = std::make_shared<std::string>(); if (not getRAW(key, *str)) return nullptr; return Serializer::unserializeView<T>(str); }
+
 	template<class T>
-	void set(const std::string &key, const T &t) { setRAW(key, Serializer::serialize(t)); }
+	void set(const std::string &key, const T &t, Codec c) { setRAW(key, Serializer::serialize(t), c); }
 
-	void set(const std::string &key, const std::string  &t) { setRAW(key, t); }
+	void set(const std::string &key, const std::string  &t, Codec c) { setRAW(key, t, c); }
+
+	template<class T>
+	void set(const std::string &key, const T &t) { set(key, t, codec); }
+
+	// Reads the given keys ahead in disk order on a background thread. The next get of each key is served from memory.
+	// At most prefetchLimit bytes are kept (see setPrefetchLimit), dropping the oldest payloads that were never read.
+	void prefetch(const std::vector<std::string> &keys) {
+		
+		Lock lock(m);
+		pending.remove_if([](std::future<void> &f){ return f.wait_for(std::chrono::seconds(0))==std::future_status::ready; });
+		pending.push_back(std::async(std::launch::async, [this, keys](){
+			for (auto &key : sortByDisk(keys)) {
+				Lock lock(m);
+				uint8_t c;
+				std::string data;
+				if (not prefetched.count(key) and getEncoded(key, data, c))
+					keepPrefetched(key, c, std::move(data));
+			}
+		}));
+	}
+
+	// Reads and unserializes the given keys in disk order on a background thread. Missing keys are absent from the result.
+	// The cache must outlive the returned future.
+	template<class T>
+	std::future<std::map<std::string, T>> getMany(const std::vector<std::string> &keys) {
+		
+		return std::async(std::launch::async, [this, keys](){
+			std::map<std::string, T> ret;
+			for (auto &key : sortByDisk(keys)) {
+				T t;
+				if (get(key, t)) ret.emplace(key, std::move(t));
+			}
+			return ret;
+		});
+	}
 	
 	void purge() { 
 		
@@ -276,6 +450,9 @@ public:
 		chunks.clear();
 		index.clear();
 		holes.clear();
+		prefetched.clear();
+		prefetchAge.clear();
+		prefetchedBytes = 0;
 		indexed = false;
 		
 		file.close();
@@ -284,17 +461,120 @@ public:
 		file << Serializer::serialize(Chunk()) << std::flush;
 	}
 	
+	// Lazy, ordered walk over the keys in [from, to). Each step looks up the successor of the current key and reads
+	// its value, so the cache may be modified while scanning: keys freed before they are reached are skipped.
+	template<class T>
+	class Scan {
+		
+		GenericCache *cache;
+		std::string from, to;
+		bool bounded;
+
+	public:
+		class iterator {
+			
+			friend class ShardedCache;
+			
+			const Scan *scan = nullptr;
+			std::pair<std::string, T> p;
+			
+			void seek(const std::string &from, bool inclusive) { 
+				if (not scan->cache->nextKey(std::string(from), inclusive, p.first) or (scan->bounded and p.first>=scan->to)) scan = nullptr; 
+			}
+			bool load() { p.second = T(); return scan->cache->get(p.first, p.second); }
+			void next(const std::string &from, bool inclusive) { for (seek(from, inclusive); scan and not load(); seek(p.first, false)); }
+			
+			iterator(const Scan *scan, bool) : scan(scan) { seek(scan->from, true); } // key only, for ShardedCache
+			
+		public:
+			iterator() {}
+			iterator(const Scan *scan) : scan(scan) { next(scan->from, true); }
+
+			const std::string &key() const { return p.first; }
+			const std::pair<std::string, T> &operator*() const { return p; }
+			const std::pair<std::string, T> *operator->() const { return &p; }
+			iterator &operator++() { next(p.first, false); return *this; }
+			bool operator==(const iterator &o) const { return scan==o.scan and (not scan or p.first==o.p.first); }
+			bool operator!=(const iterator &o) const { return not (*this == o); }
+		};
+		
+		Scan(GenericCache *cache, std::string from, std::string to, bool bounded) : cache(cache), from(from), to(to), bounded(bounded) {}
+		
+		iterator begin() const { return iterator(this); }
+		iterator end() const { return iterator(); }
+	};
+
+	template<class T=std::string>
+	Scan<T> range(const std::string &from, const std::string &to) { return Scan<T>(this, from, to, true); }
+
+	template<class T=std::string>
+	Scan<T> scan(const std::string &prefix) {
+		
+		std::string to = prefix; // smallest string greater than every key starting with prefix
+		while (not to.empty() and uint8_t(to.back())==0xFF) to.pop_back();
+		if (to.empty()) return Scan<T>(this, prefix, "", false);
+		to.back()++;
+		return Scan<T>(this, prefix, to, true);
+	}
+
 	std::vector<std::string> getKeys() {
 		
 		Lock lock(m); 
 		std::vector<std::string> keys;
-		for (auto &c : chunks) keys.push_back(c.key);
-		//std::sort(keys.begin(), keys.end());
+		for (auto &i : index) keys.push_back(i.first);
 		return keys;
 	}
 
 	void free(const std::string &key) { Lock lock(m); freeAndGetCount(key); }
 
+	void checkReads(bool check) { Lock lock(m); verifyReads = check; }
+
+	void setPrefetchLimit(size_t bytes) { Lock lock(m); prefetchLimit = bytes; while (prefetchedBytes>prefetchLimit) dropPrefetched(prefetchAge.front()); }
+
+	// Checks every payload against its checksum using large sequential reads, split over nThreads readers.
+	// Returns the keys of the damaged chunks. The cache is locked meanwhile.
+	std::vector<std::string> verify(size_t nThreads = std::thread::hardware_concurrency()) {
+		
+		constexpr size_t BlockSize = 1<<24;
+		
+		Lock lock(m);
+		if (not file.is_open()) return {};
+		file.flush();
+		
+		std::vector<const Chunk *> todo;
+		for (auto &chunk : chunks) todo.push_back(&chunk);
+		nThreads = std::max(size_t(1), std::min(nThreads, todo.size()));
+		
+		std::vector<std::vector<std::string>> bad(nThreads);
+		std::vector<std::thread> threads;
+		for (size_t t=0; t<nThreads; t++) {
+			threads.emplace_back([&, t](){
+				std::ifstream in(filename, std::ios::binary);
+				std::string buf;
+				size_t bufPos = 0;
+				for (size_t i=todo.size()*t/nThreads; i<todo.size()*(t+1)/nThreads; i++) {
+					const Chunk &c = *todo[i];
+					if (c.dataPos<bufPos or c.dataPos+c.dataSize>bufPos+buf.size()) { // refill
+						bufPos = c.dataPos;
+						buf.resize(std::max(c.dataSize, BlockSize));
+						in.clear(); 
+						in.seekg(bufPos); 
+						in.read(&buf[0], buf.size()); 
+						buf.resize(in.gcount());
+					}
+					if (c.dataPos+c.dataSize>bufPos+buf.size() or crc(&buf[c.dataPos-bufPos], c.dataSize)!=c.checksum)
+						bad[t].push_back(c.key);
+				}
+			});
+		}
+		for (auto &thread : threads) thread.join();
+
+		std::vector<std::string> ret;
+		for (auto &b : bad) ret.insert(ret.end(), b.begin(), b.end());
+		if (not ret.empty()) Log(2) << "GenericCache: " << ret.size() << " damaged chunks in " << filename;
+		return ret;
+	}
+
 	size_t usage() {
 		
 		Lock lock(m); 
@@ -304,6 +584,161 @@ public:
 		return ret;
 	}
 };
+
+// Spreads keys over several GenericCache files (possibly on different disks), each with its own lock and index.
+class ShardedCache : private boost::noncopyable {
+
+	std::vector<std::unique_ptr<GenericCache>> shards;
+
+	// FNV-1a: unlike std::hash, stable across platforms and library versions, so keys on disk stay reachable
+	size_t shardOf(const std::string &key) const {
+		uint64_t h = 14695981039346656037ull;
+		for (unsigned char c : key) h = (h ^ c) * 1099511628211ull;
+		return h % shards.size();
+	}
+
+	GenericCache &shard(const std::string &key) { return *shards[shardOf(key)]; }
+
+	std::vector<std::vector<std::string>> split(const std::vector<std::string> &keys) {
+		
+		std::vector<std::vector<std::string>> ret(shards.size());
+		for (auto &key : keys) ret[shardOf(key)].push_back(key);
+		return ret;
+	}
+
+public:
+
+	// The same filenames must be given in the same order every time, as they determine where each key lives.
+	ShardedCache(const std::vector<std::string> &filenames, GenericCache::Codec codec = GenericCache::RAW) {
+		
+		for (auto &filename : filenames)
+			shards.emplace_back(new GenericCache(filename, codec));
+		Assert(not shards.empty()) << "ShardedCache needs at least one file";
+	}
+
+	ShardedCache(const std::string &filename, size_t nShards, GenericCache::Codec codec = GenericCache::RAW) : 
+		ShardedCache([&](){ std::vector<std::string> f; for (size_t i=0; i<nShards; i++) f.push_back(filename+"."+std::to_string(i)); return f; }(), codec) {}
+
+	template<class T>
+	bool get(const std::string &key, T &t) { return shard(key).get(key, t); }
+
+	template<class T>
+	void set(const std::string &key, const T &t) { shard(key).set(key, t); }
+
+	template<class T>
+	void set(const std::string &key, const T &t, GenericCache::Codec c) { shard(key).set(key, t, c); }
+
+	void prefetch(const std::vector<std::string> &keys) {
+		
+		auto splitKeys = split(keys);
+		for (size_t i=0; i<shards.size(); i++)
+			if (not splitKeys[i].empty()) shards[i]->prefetch(splitKeys[i]);
+	}
+
+	// Shards are read concurrently. The cache must outlive the returned future.
+	template<class T>
+	std::future<std::map<std::string, T>> getMany(const std::vector<std::string> &keys) {
+		
+		auto futures = std::make_shared<std::vector<std::future<std::map<std::string, T>>>>();
+		auto splitKeys = split(keys);
+		for (size_t i=0; i<shards.size(); i++)
+			if (not splitKeys[i].empty()) futures->push_back(shards[i]->getMany<T>(splitKeys[i]));
+
+		return std::async(std::launch::async, [futures](){
+			std::map<std::string, T> ret;
+			for (auto &f : *futures) { auto m = f.get(); ret.insert(std::make_move_iterator(m.begin()), std::make_move_iterator(m.end())); }
+			return ret;
+		});
+	}
+
+	void purge() { for (auto &s : shards) s->purge(); }
+
+	// Ordered walk over all shards, with the semantics of GenericCache::Scan. Shards hold disjoint keys, so each step
+	// picks the shard whose next key is smallest and only then reads its value, skipping it if it was freed meanwhile.
+	template<class T>
+	class Scan {
+		
+		std::vector<GenericCache::Scan<T>> scans;
+
+	public:
+		class iterator {
+			
+			std::vector<typename GenericCache::Scan<T>::iterator> its;
+			size_t cur = 0;
+			
+			void pick() {
+				while (true) {
+					cur = its.size();
+					for (size_t i=0; i<its.size(); i++)
+						if (its[i].scan and (cur==its.size() or its[i].key()<its[cur].key())) cur = i;
+					if (cur==its.size() or its[cur].load()) return;
+					its[cur].seek(its[cur].key(), false);
+				}
+			}
+			
+		public:
+			iterator() {}
+			iterator(const Scan *scan) { for (auto &s : scan->scans) its.push_back(typename GenericCache::Scan<T>::iterator(&s, true)); pick(); }
+
+			const std::string &key() const { return its[cur].key(); }
+			const std::pair<std::string, T> &operator*() const { return *its[cur]; }
+			const std::pair<std::string, T> *operator->() const { return &*its[cur]; }
+			iterator &operator++() { its[cur].seek(its[cur].key(), false); pick(); return *this; }
+			bool operator==(const iterator &o) const { return (cur==its.size())==(o.cur==o.its.size()) and (cur==its.size() or key()==o.key()); }
+			bool operator!=(const iterator &o) const { return not (*this == o); }
+		};
+		
+		Scan(std::vector<GenericCache::Scan<T>> &&scans) : scans(std::move(scans)) {}
+		
+		iterator begin() const { return iterator(this); }
+		iterator end() const { return iterator(); }
+	};
+
+	template<class T=std::string>
+	Scan<T> range(const std::string &from, const std::string &to) {
+		
+		std::vector<GenericCache::Scan<T>> scans;
+		for (auto &s : shards) scans.push_back(s->range<T>(from, to));
+		return Scan<T>(std::move(scans));
+	}
+
+	template<class T=std::string>
+	Scan<T> scan(const std::string &prefix) {
+		
+		std::vector<GenericCache::Scan<T>> scans;
+		for (auto &s : shards) scans.push_back(s->scan<T>(prefix));
+		return Scan<T>(std::move(scans));
+	}
+
+	std::vector<std::string> getKeys() {
+		
+		std::vector<std::string> keys;
+		for (auto &s : shards) { auto k = s->getKeys(); keys.insert(keys.end(), k.begin(), k.end()); }
+		std::sort(keys.begin(), keys.end());
+		return keys;
+	}
+
+	void free(const std::string &key) { shard(key).free(key); }
+
+	void checkReads(bool check) { for (auto &s : shards) s->checkReads(check); }
+
+	std::vector<std::string> verify() {
+		
+		std::vector<std::future<std::vector<std::string>>> futures;
+		size_t nThreads = std::max(size_t(1), std::thread::hardware_concurrency()/shards.size());
+		for (auto &s : shards) futures.push_back(std::async(std::launch::async, [&s, nThreads](){ return s->verify(nThreads); }));
+		std::vector<std::string> ret;
+		for (auto &f : futures) { auto b = f.get(); ret.insert(ret.end(), b.begin(), b.end()); }
+		return ret;
+	}
+
+	size_t usage() {
+		
+		size_t ret = 0;
+		for (auto &s : shards) ret += s->usage();
+		return ret;
+	}
+};
 }
 
 
@@ -2,29 +2,38 @@
 #include <lz4.h>
 #include <lz4hc.h>
 #include <string>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
 
 namespace uSnippets {
 namespace Codecs {
 namespace LZ4 {
 static inline size_t encode( const std::string &in, std::string &out, uint level) {
-	/*
-	uint64_t sz = in.size(); std::memcpy((char *)out.data(), &sz, 8);
 
-	out.resize(LZ4_compressBound(8+in.size()));
+	if (in.size()>LZ4_MAX_INPUT_SIZE) throw std::runtime_error("input too large for lz4");
+	uint64_t sz = in.size();
+	out.resize(8+LZ4_compressBound(in.size()));
+	std::memcpy(&out[0], &sz, 8);
+
+	int n;
 	if (level>5)
-		out.resize(8+LZ4_compress_HC(in.data(), (char *)out.data()+8, in.size(), out.size(), level-2));
+		n = LZ4_compress_HC(in.data(), &out[8], in.size(), out.size()-8, level-2);
 	else
-		out.resize(8+LZ4_compress_fast(in.data(), (char *)out.data()+8, in.size(), out.size(), 6-level));
-	*/return out.size();
+		n = LZ4_compress_fast(in.data(), &out[8], in.size(), out.size()-8, 6-level);
+	if (n<=0 and not in.empty()) throw std::runtime_error("error encoding lz4 packet");
+	out.resize(8+std::max(n,0));
+	return out.size();
 }
 
 static inline size_t decode( const std::string &in, std::string &out) {
 
-	/*uint64_t sz = 0; std::memcpy(&sz, in.data(), 8);
+	if (in.size()<8) throw std::runtime_error("error decoding lz4 packet");
+	uint64_t sz = 0; std::memcpy(&sz, in.data(), 8);
 	out.resize(sz);
-	int ret = LZ4_decompress_fast(in.data()+8, (char *)out.data(), sz);
-	if (ret<0) throw std::runtime_error("error decoding lz4 packet");
-	*/return out.size();
+	int ret = LZ4_decompress_safe(in.data()+8, &out[0], in.size()-8, sz);
+	if (ret<0 or uint64_t(ret)!=sz) throw std::runtime_error("error decoding lz4 packet");
+	return out.size();
 }
 
 static inline std::string encode( const std::string &in, uint level=5 ) { std::string out; encode(in, out, level); return out; }
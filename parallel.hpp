@@ -0,0 +1,48 @@
+////////////////////////////////////////////////////////////////////////
+// Minimal parallel loop shared by the serializer and tensors
+//
+// license: LGPLv3
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace uSnippets {
+
+// Whether this thread is running a parallelFor body, shared by all translation units
+inline bool &insideParallelFor() { static thread_local bool inside = false; return inside; }
+
+// Runs f(0)..f(n-1) on up to hardware_concurrency threads, the caller included.
+// Nested calls (e.g. chunked values inside chunked values) run serially on the thread that makes them.
+// The first exception stops handing out indices and is rethrown once all threads joined.
+template<typename F>
+static inline void parallelFor(size_t n, F f) {
+
+	if (n<2 or insideParallelFor()) { for (size_t i=0; i<n; i++) f(i); return; }
+
+	std::atomic<size_t> next(0);
+	std::exception_ptr error;
+	std::mutex mtx;
+	auto run = [&](){
+		insideParallelFor() = true;
+		for (size_t i; (i=next++)<n;) {
+			try { f(i); } catch (...) {
+				std::lock_guard<std::mutex> l(mtx);
+				if (not error) error = std::current_exception();
+				next = n;
+			}
+		}
+		insideParallelFor() = false;
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t t=1; t<std::min(n, size_t(std::thread::hardware_concurrency())); t++) threads.emplace_back(run);
+	run();
+	for (auto &t : threads) t.join();
+	if (error) std::rethrow_exception(error);
+}
+}
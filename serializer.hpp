@@ -7,12 +7,150 @@
 
 #pragma once
 #include <uSnippets/object.hpp>
+#include <uSnippets/log.hpp>
+#include <uSnippets/parallel.hpp>
+#include <array>
+#include <fstream>
+#include <limits>
+#include <atomic>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+
+// Inside a trivially copyable struct, listing all its fields: USNIPPETS_SERIALIZE_RAW(x, y, z);
+// It is serialized as one copy of its sizeof bytes (host layout, no per field hooks). Where the struct is defined, the listed
+// fields must be distinct and add up to sizeof, so structs with padding, whose bytes are indeterminate, fail to compile.
+#define USNIPPETS_SERIALIZE_RAW(...) typedef std::true_type serializeAsRaw; \
+	static constexpr size_t serializeRawBytes() { return decltype(uSnippets::Serializer::packedBytes(__VA_ARGS__))::value; } \
+	void serializeRawCheck() const { \
+		typedef typename std::decay<decltype(*this)>::type RawSelf; \
+		static_assert(std::is_trivially_copyable<RawSelf>::value, "USNIPPETS_SERIALIZE_RAW needs a trivially copyable type"); \
+		static_assert(uSnippets::Serializer::distinctMembers(USNIPPETS_RAW_MEMBERS(RawSelf, __VA_ARGS__)), "USNIPPETS_SERIALIZE_RAW lists a field twice"); \
+		static_assert(serializeRawBytes()==sizeof(RawSelf), "USNIPPETS_SERIALIZE_RAW needs every field listed, each without padding, and no padding between them"); }
+
+// &S::a, &S::b, ... for up to 32 fields
+#define USNIPPETS_RAW_NARGS(...) USNIPPETS_RAW_NTH(__VA_ARGS__, 32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1)
+#define USNIPPETS_RAW_NTH(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, _32, n, ...) n
+#define USNIPPETS_RAW_CAT(a, b) a##b
+#define USNIPPETS_RAW_MEMBERS_(n, S, ...) USNIPPETS_RAW_CAT(USNIPPETS_RAW_M, n)(S, __VA_ARGS__)
+#define USNIPPETS_RAW_MEMBERS(S, ...) USNIPPETS_RAW_MEMBERS_(USNIPPETS_RAW_NARGS(__VA_ARGS__), S, __VA_ARGS__)
+#define USNIPPETS_RAW_M1(S, a) &S::a
+#define USNIPPETS_RAW_M2(S, a, ...) &S::a, USNIPPETS_RAW_M1(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M3(S, a, ...) &S::a, USNIPPETS_RAW_M2(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M4(S, a, ...) &S::a, USNIPPETS_RAW_M3(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M5(S, a, ...) &S::a, USNIPPETS_RAW_M4(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M6(S, a, ...) &S::a, USNIPPETS_RAW_M5(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M7(S, a, ...) &S::a, USNIPPETS_RAW_M6(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M8(S, a, ...) &S::a, USNIPPETS_RAW_M7(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M9(S, a, ...) &S::a, USNIPPETS_RAW_M8(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M10(S, a, ...) &S::a, USNIPPETS_RAW_M9(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M11(S, a, ...) &S::a, USNIPPETS_RAW_M10(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M12(S, a, ...) &S::a, USNIPPETS_RAW_M11(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M13(S, a, ...) &S::a, USNIPPETS_RAW_M12(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M14(S, a, ...) &S::a, USNIPPETS_RAW_M13(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M15(S, a, ...) &S::a, USNIPPETS_RAW_M14(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M16(S, a, ...) &S::a, USNIPPETS_RAW_M15(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M17(S, a, ...) &S::a, USNIPPETS_RAW_M16(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M18(S, a, ...) &S::a, USNIPPETS_RAW_M17(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M19(S, a, ...) &S::a, USNIPPETS_RAW_M18(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M20(S, a, ...) &S::a, USNIPPETS_RAW_M19(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M21(S, a, ...) &S::a, USNIPPETS_RAW_M20(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M22(S, a, ...) &S::a, USNIPPETS_RAW_M21(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M23(S, a, ...) &S::a, USNIPPETS_RAW_M22(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M24(S, a, ...) &S::a, USNIPPETS_RAW_M23(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M25(S, a, ...) &S::a, USNIPPETS_RAW_M24(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M26(S, a, ...) &S::a, USNIPPETS_RAW_M25(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M27(S, a, ...) &S::a, USNIPPETS_RAW_M26(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M28(S, a, ...) &S::a, USNIPPETS_RAW_M27(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M29(S, a, ...) &S::a, USNIPPETS_RAW_M28(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M30(S, a, ...) &S::a, USNIPPETS_RAW_M29(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M31(S, a, ...) &S::a, USNIPPETS_RAW_M30(S, __VA_ARGS__)
+#define USNIPPETS_RAW_M32(S, a, ...) &S::a, USNIPPETS_RAW_M31(S, __VA_ARGS__)
 
 namespace cv { template<class> struct Mat_; template<class,int> struct Vec; template<class,int, int> struct Matx; }
 
 namespace uSnippets {
 
 class Serializer {
+public:
+	// How integers (and therefore all sizes) are encoded. Floating point and raw data are always binary.
+	// TEXT: decimal digits terminated by '|'. BINARY: zigzag LEB128 varints.
+	enum Format { TEXT, BINARY };
+
+	// Per stream format selector, TEXT by default
+	static long &format(std::ios_base &s) { static const int i = std::ios_base::xalloc(); return s.iword(i); }
+
+	// Wrapper for large vectors: ar & Serializer::chunked(v). Elements are split in chunks that are encoded and decoded 
+	// in parallel. A table of chunk byte lengths precedes the payloads, so a single chunk can be read with unserializeChunk.
+	template<class V> struct Chunked { V &v; size_t elementsPerChunk; };
+	template<class V> static Chunked<V> chunked(V &v, size_t elementsPerChunk = 1<<14) { return Chunked<V>{v, elementsPerChunk}; }
+
+	// Types whose object representation has no padding (see USNIPPETS_SERIALIZE_RAW)
+	template<class F, class = void> struct isPacked : std::integral_constant<bool, (std::is_arithmetic<F>::value and not std::is_same<F, long double>::value) or std::is_enum<F>::value> {};
+	template<class F> struct isPacked<F, typename std::enable_if<F::serializeAsRaw::value>::type> : std::integral_constant<bool, F::serializeRawBytes()==sizeof(F)> {};
+	template<class F, std::size_t N> struct isPacked<F[N]> : isPacked<F> {};
+	template<class F, std::size_t N> struct isPacked<std::array<F,N>> : isPacked<F> {};
+	template<class F, int N> struct isPacked<cv::Vec<F,N>> : isPacked<F> {};
+	template<class F, int R, int C> struct isPacked<cv::Matx<F,R,C>> : isPacked<F> {};
+
+	// Bytes of the packed fields among F..., only used unevaluated
+	template<class... F> struct PackedBytes : std::integral_constant<size_t, 0> {};
+	template<class F, class... R> struct PackedBytes<F, R...> : std::integral_constant<size_t, (isPacked<F>::value ? sizeof(F) : 0) + PackedBytes<R...>::value> {};
+	template<class... F> static PackedBytes<F...> packedBytes(const F &...);
+
+	// Whether no member pointer among m... repeats. Only pointers of the same type can be equal.
+	template<class A, class B> static constexpr bool sameMember(A, B) { return false; }
+	template<class A> static constexpr bool sameMember(A a, A b) { return a==b; }
+	template<class A> static constexpr bool notAmong(A) { return true; }
+	template<class A, class B, class... R> static constexpr bool notAmong(A a, B b, R... r) { return not sameMember(a, b) and notAmong(a, r...); }
+	static constexpr bool distinctMembers() { return true; }
+	template<class A, class... R> static constexpr bool distinctMembers(A a, R... r) { return notAmong(a, r...) and distinctMembers(r...); }
+
+	// STREAM BUFFERS: let the stream based drivers below work directly on memory, without the copies of string streams
+	class SizeBuf : public std::streambuf { // Discards everything, only counts
+		size_t n = 0;
+	protected:
+		std::streamsize xsputn(const char *, std::streamsize count) override { n += count; return count; }
+		int_type overflow(int_type c) override { if (c!=traits_type::eof()) n++; return traits_type::not_eof(c); }
+	public:
+		size_t size() const { return n; }
+		void add(size_t count) { n += count; }
+	};
+
+	class StringBuf : public std::streambuf { // Writes into a string that doubles its capacity as needed
+		std::string s;
+		size_t n = 0;
+	protected:
+		std::streamsize xsputn(const char *p, std::streamsize count) override { 
+			if (n+count > s.size()) s.resize(std::max(2*s.size(), n+size_t(count)));
+			std::copy(p, p+count, &s[n]); n += count; return count; }
+		int_type overflow(int_type c) override { if (c!=traits_type::eof()) { char ch = c; xsputn(&ch, 1); } return traits_type::not_eof(c); }
+	public:
+		size_t size() const { return n; }
+		std::string &str() { s.resize(n); return s; }
+	};
+
+	class SpanBuf : public std::streambuf { // Writes into, or reads from, a caller provided buffer. Never reallocates.
+	protected:
+		pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+			if ((which & std::ios_base::in) and eback()) {
+				char *p = (dir==std::ios_base::beg?eback():(dir==std::ios_base::cur?gptr():egptr())) + off;
+				if (p<eback() or p>egptr()) return pos_type(off_type(-1));
+				setg(eback(), p, egptr());
+				return pos_type(p-eback());
+			}
+			if ((which & std::ios_base::out) and pbase() and off==0 and dir==std::ios_base::cur) return pos_type(pptr()-pbase());
+			return pos_type(off_type(-1));
+		}
+		pos_type seekpos(pos_type pos, std::ios_base::openmode which) override { return seekoff(off_type(pos), std::ios_base::beg, which); }
+	public:
+		SpanBuf(char *data, size_t size) { setp(data, data+size); }
+		SpanBuf(const char *data, size_t size) { char *d = const_cast<char *>(data); setg(d, d, d+size); }
+		size_t written() const { return pptr()-pbase(); }
+		size_t consumed() const { return gptr()-eback(); }
+		const char *view(size_t n) { if (size_t(egptr()-gptr())<n) return nullptr; char *p = gptr(); setg(eback(), p+n, egptr()); return p; }
+	};
+
 protected:
 	constexpr Serializer() noexcept = delete;
 	Serializer(const Serializer&) = delete;
@@ -25,12 +163,38 @@ protected:
 	template<class T, typename std::enable_if<std::is_const<T>::value,int>::type=0> 
 	static void pU(std::istream &is, T &t) { pU(is, *const_cast<typename std::remove_cv<T>::type*>(&t)); }
 	
+	// VIEWS: only enabled by unserializeView, which guarantees that the stream buffer is a SpanBuf
+	static long &viewMode(std::ios_base &s) { static const int i = std::ios_base::xalloc(); return s.iword(i); }
+	static const char *view(std::istream &is, size_t n) { const char *p = static_cast<SpanBuf *>(is.rdbuf())->view(n); if (not p) is.setstate(std::ios_base::failbit); return p; }
+
+	// SIZES READ FROM THE INPUT: never trusted for allocations beyond the bytes that are already buffered
+	static size_t available(std::istream &is) { std::streamsize n = is.rdbuf()->in_avail(); return n>0?size_t(n):0; }
+
+	// Reads sz elements of a contiguous container, growing it as data arrives, so a corrupt size fails instead of allocating
+	template<class C> 
+	static void readSized(std::istream &is, C &t, size_t sz) {
+		typedef typename C::value_type T;
+		if (sz > std::numeric_limits<size_t>::max()/sizeof(T)) { is.setstate(std::ios_base::failbit); return; }
+		if (sz*sizeof(T) <= available(is)) { t.resize(sz); is.read((char *)&t[0], sz*sizeof(T)); return; }
+		t.clear();
+		for (size_t n=0, m; n<sz and is; n+=m) {
+			m = std::min(sz-n, std::max(n, (size_t(1)<<20)/sizeof(T)));
+			t.resize(n+m); 
+			is.read((char *)&t[n], m*sizeof(T));
+		}
+	}
+
 	// STRINGING
 	static void pS(std::ostream &os, const char *s) = delete; //disable serializing of constant strings. leads to dangerous behavior.
 	static void pU(std::ostream &os, char *s) = delete;       //disable serializing of constant strings. leads to dangerous behavior.
 
 	static void pS(std::ostream &os, const std::string &s) { pS(os,s.size()); os << s; }
-	static void pU(std::istream &is, std::string &t) { size_t sz; pU(is,sz); t.resize(sz); is.read(&t[0],sz); }
+	static void pU(std::istream &is, std::string &t) { size_t sz=0; pU(is,sz); readSized(is,t,sz); }
+
+#if __cplusplus >= 201703L
+	static void pS(std::ostream &os, const std::string_view &s) { pS(os,s.size()); os.write(s.data(),s.size()); }
+	static void pU(std::istream &is, std::string_view &t) { size_t sz; pU(is,sz); const char *p = nullptr; if (viewMode(is)) p = view(is,sz); else is.setstate(std::ios_base::failbit); if (p) t = std::string_view(p,sz); }
+#endif
 
 	// ARRAYS OF FIXED SIZE AND SIMPLE CONTENT
 	template<class T, std::size_t N, typename std::enable_if<std::is_arithmetic<T>::value,int>::type=0>
@@ -42,14 +206,39 @@ protected:
 	// ARITHMETIC INTEGER
 	template<class T, typename std::enable_if<std::is_integral<T>::value,int>::type=0, typename std::enable_if<not std::is_const<T>::value,int>::type=0>
 	static void pS(std::ostream &os, const T &v) {
-		char c[64], *cp=&c[63]; *cp--='|'; T mv=std::abs(v); while (mv) {*cp--='0'+mv%10; mv/=10;} if (v<0) *cp--='-';
+		if (format(os)==BINARY) {
+			uint64_t u = std::is_signed<T>::value ? (uint64_t(int64_t(v))<<1) ^ uint64_t(int64_t(v)>>63) : uint64_t(v);
+			char c[10], *cp=&c[0]; while (u>=0x80) { *cp++=char(u|0x80); u>>=7; } *cp++=char(u);
+			os.write(c,cp-c); return; }
+		char c[64], *cp=&c[63]; *cp--='|'; uint64_t mv=(v<0?0-uint64_t(v):uint64_t(v)); while (mv) {*cp--='0'+mv%10; mv/=10;} if (v<0) *cp--='-';
 		os.write(cp+1,&c[64]-(cp+1));}
 	
 	template<class T, typename std::enable_if<std::is_integral<T>::value,int>::type=0, typename std::enable_if<not std::is_const<T>::value,int>::type=0> 
 	static void pU(std::istream &is, T &t) { 
+		if (format(is)==BINARY) {
+			uint64_t u=0; int c=0; 
+			for (int s=0; s<64 and (c=is.rdbuf()->sbumpc())!=std::char_traits<char>::eof(); s+=7) { u|=uint64_t(c&0x7F)<<s; if (not (c&0x80)) break; }
+			if (c==std::char_traits<char>::eof()) is.setstate(std::ios_base::eofbit | std::ios_base::failbit);
+			else if (c&0x80) is.setstate(std::ios_base::failbit); // more than 10 bytes, not written by us
+			t = T(std::is_signed<T>::value ? uint64_t(int64_t(u>>1) ^ -int64_t(u&1)) : u); return; }
 		char c[64], *p=&c[0]; is.getline(c,64,'|'); 
 		if (*p=='-') p++; t=0; while (*p) t=10*t+ *p++ -'0'; t*=(c[0]=='-'?-1:1);  }
 
+	// Non negative integer written in n bytes, n at least its usual size: zero padded digits, or a varint with redundant 
+	// continuation bytes. Readers decode the usual value, so this shifts what follows to an aligned offset within the format.
+	static size_t paddedSize(std::ostream &os, int64_t v) { 
+		size_t n=1; 
+		if (format(os)==BINARY) for (uint64_t u=uint64_t(v)<<1; u>=0x80; u>>=7) n++;
+		else for (; v; v/=10) n++; 
+		return n; }
+
+	static void pSPadded(std::ostream &os, int64_t v, size_t n) {
+		if (n<=paddedSize(os,v)) return pS(os,v);
+		std::string s;
+		if (format(os)==BINARY) for (uint64_t u=uint64_t(v)<<1; s.size()<n; u>>=7) s += char((u&0x7F) | (s.size()+1<n?0x80:0));
+		else { s = std::string(n-paddedSize(os,v),'0'); if (v) s += std::to_string(v); s += '|'; }
+		os.write(s.data(), s.size()); }
+
 	// ARITHMETIC FLOATING POINT
 	template<class T, typename std::enable_if<std::is_floating_point<T>::value,int>::type=0, typename std::enable_if<not std::is_const<T>::value,int>::type=0> 
 	static void pS(std::ostream &os, const T &v) { os.write((const char *)&v,sizeof(v)); }
@@ -65,11 +254,43 @@ protected:
 	static void pU(std::istream &is, std::pair<K,T> &t) { pU(is,t.first); pU(is,t.second); } 
 	
 	// CONTAINERS
+	template<class T> static auto reserve(T &t, size_t sz, int) -> decltype(t.reserve(sz), void()) { t.reserve(sz); }
+	template<class T> static void reserve(T &, size_t, long) {}
+
 	template<class T, class   = typename T::value_type, class = decltype(std::declval<T>().clear())> 
 	static void pS(std::ostream &os, const T &v) { pS(os,v.size()); for (auto &e: v) pS(os,e); }
 	
-	template<class T, class I = typename T::value_type, class = decltype(std::declval<T>().clear())> 
-	static void pU(std::istream &is, T &t) { size_t sz; pU(is,sz); t.clear(); while (sz--) { I i; pU(is,i); t.insert(t.end(),std::move(i)); }} 
+	template<class...> struct voider { typedef void type; };
+	template<class T, class = void> struct isMap : std::false_type {};
+	template<class T> struct isMap<T, typename voider<typename T::mapped_type>::type> : std::true_type {};
+
+	template<class T, class I = typename T::value_type, class = decltype(std::declval<T>().clear()), typename std::enable_if<not isMap<T>::value,int>::type=0> 
+	static void pU(std::istream &is, T &t) { size_t sz=0; pU(is,sz); t.clear(); reserve(t,std::min(sz,available(is)),0); for (; sz and is; sz--) { I i; pU(is,i); t.insert(t.end(),std::move(i)); }} 
+
+	// MAPS: entries are read with a non const key, so that both key and value are moved into place
+	template<class T, typename std::enable_if<isMap<T>::value,int>::type=0> 
+	static void pU(std::istream &is, T &t) { size_t sz=0; pU(is,sz); t.clear(); reserve(t,std::min(sz,available(is)),0); 
+		for (; sz and is; sz--) { std::pair<typename T::key_type, typename T::mapped_type> i; pU(is,i); t.emplace_hint(t.end(), std::move(i.first), std::move(i.second)); }} 
+
+	// RAW AGGREGATES (see USNIPPETS_SERIALIZE_RAW)
+	template<class T, typename std::enable_if<T::serializeAsRaw::value,int>::type=0>
+	static void pS(std::ostream &os, const T &v) { (void)&T::serializeRawCheck; os.write((const char *)&v, sizeof(T)); } // checks class templates too
+
+	template<class T, typename std::enable_if<T::serializeAsRaw::value,int>::type=0>
+	static void pU(std::istream &is, T &t) { is.read((char *)&t, sizeof(T)); }
+
+	// VECTORS OF RAW ELEMENTS (those whose own pS is a plain memory write): one block, same bytes as element by element
+	template<class T, class = void> struct isRaw : std::is_floating_point<T> {};
+	template<class T> struct isRaw<T, typename std::enable_if<T::serializeAsRaw::value>::type> : std::true_type {};
+	template<class T, std::size_t N> struct isRaw<std::array<T,N>> : std::is_arithmetic<T> {};
+	template<class T, int N> struct isRaw<cv::Vec<T,N>> : std::true_type {};
+	template<class T, int R, int C> struct isRaw<cv::Matx<T,R,C>> : std::true_type {};
+
+	template<class T, class A, typename std::enable_if<isRaw<T>::value,int>::type=0>
+	static void pS(std::ostream &os, const std::vector<T,A> &v) { pS(os,v.size()); os.write((const char *)v.data(), v.size()*sizeof(T)); }
+
+	template<class T, class A, typename std::enable_if<isRaw<T>::value,int>::type=0>
+	static void pU(std::istream &is, std::vector<T,A> &t) { size_t sz=0; pU(is,sz); readSized(is,t,sz); }
 
 	// ARRAYS
 	template<typename T, std::size_t Size>
@@ -80,7 +301,143 @@ protected:
 
 	// SERIALIZATIONS
 	struct Reader { std::ostream *os; template<class T> Reader &operator&(const T &t) { pS(*os,t); return *this;} };
-	struct Writer { std::istream *is; template<class T> Writer &operator&(T &t) { pU(*is,t); return *this;} };
+	struct Writer { std::istream *is; template<class T> Writer &operator&(T &t) { pU(*is,t); return *this;} 
+		template<class V> Writer &operator&(Chunked<V> &&c) { pU(*is,c); return *this;} };
+
+	// CHUNKED VECTORS (see chunked)
+	template<class V> struct isBitVector : std::false_type {};
+	template<class A> struct isBitVector<std::vector<bool,A>> : std::true_type {};
+
+	template<class V> 
+	static void writeRange(std::ostream &os, const V &v, size_t first, size_t last) { 
+		if (isRaw<typename V::value_type>::value) os.write((const char *)&v[first], (last-first)*sizeof(v[first]));
+		else for (size_t e=first; e<last; e++) pS(os,v[e]); }
+
+	template<class V> 
+	static void readRange(std::istream &is, V &v, size_t first, size_t last) { 
+		if (isRaw<typename V::value_type>::value) is.read((char *)&v[first], (last-first)*sizeof(v[first]));
+		else for (size_t e=first; e<last; e++) pU(is,v[e]); }
+
+	// Bits share words, so elements go through a bool and their chunks are not decoded concurrently
+	template<class A> 
+	static void writeRange(std::ostream &os, const std::vector<bool,A> &v, size_t first, size_t last) { for (size_t e=first; e<last; e++) pS(os,bool(v[e])); }
+
+	template<class A> 
+	static void readRange(std::istream &is, std::vector<bool,A> &v, size_t first, size_t last) { for (size_t e=first; e<last; e++) { bool b=false; pU(is,b); v[e]=b; } }
+
+	// The chunk table must cover exactly n elements. Raw chunks must hold exactly their elements, other ones at least a byte
+	// per element, so the element count read never allocates more than the bytes that arrive.
+	template<class V>
+	static bool validChunks(uint64_t n, uint64_t per, const std::vector<uint64_t> &lengths) {
+		if (not per or lengths.size()!=n/per+(n%per!=0)) return false;
+		const size_t sz = sizeof(typename V::value_type);
+		for (size_t i=0; i<lengths.size(); i++) {
+			uint64_t count = std::min(per, n-i*per);
+			if (isRaw<typename V::value_type>::value ? (lengths[i]%sz or lengths[i]/sz!=count) : lengths[i]<count) return false;
+		}
+		return true;
+	}
+
+	template<class V>
+	static void pS(std::ostream &os, const Chunked<V> &c) {
+		
+		const auto &v = c.v; 
+		uint64_t n = v.size(), per = std::max(size_t(1), c.elementsPerChunk), nChunks = n/per+(n%per!=0);
+		Format f = Format(format(os));
+		SizeBuf *counter = dynamic_cast<SizeBuf *>(os.rdbuf()); // only counting (see size), payloads are not needed
+		std::vector<uint64_t> lengths(nChunks);
+		std::vector<std::string> chunks(counter?0:nChunks);
+		parallelFor(nChunks, [&](size_t i){ // each chunk is encoded once, its length is the size of its buffer
+			size_t first = i*per, last = first+std::min(per, n-first);
+			if (counter and isRaw<typename V::value_type>::value) { lengths[i] = (last-first)*sizeof(typename V::value_type); return; }
+			if (counter) { SizeBuf sb; std::ostream sos(&sb); format(sos)=f; writeRange(sos, v, first, last); lengths[i] = sb.size(); return; }
+			StringBuf sb; std::ostream sos(&sb); format(sos)=f; writeRange(sos, v, first, last);
+			chunks[i].swap(sb.str()); 
+			lengths[i] = chunks[i].size();
+		});
+
+		pS(os,n); pS(os,per); pS(os,lengths);
+		if (counter) for (auto &l : lengths) counter->add(l);
+		for (auto &chunk : chunks) os.write(chunk.data(), chunk.size());
+	}
+
+	template<class V>
+	static void pU(std::istream &is, Chunked<V> &c) {
+
+		auto &v = c.v;
+		uint64_t n=0, per=0; 
+		std::vector<uint64_t> lengths;
+		pU(is,n); pU(is,per); pU(is,lengths);
+		if (not validChunks<V>(n, per, lengths)) is.setstate(std::ios_base::failbit);
+		if (not is) return;
+
+		// Chunk payloads are taken in place from memory buffers. Other streams are read and decoded a group of chunks 
+		// (up to 64MB) at a time, and v only grows by the elements of the group that arrived.
+		SpanBuf *source = dynamic_cast<SpanBuf *>(is.rdbuf());
+		std::vector<const char *> data(lengths.size());
+		std::string buffer;
+		Format f = Format(format(is)); 
+		long vm = source ? viewMode(is) : 0;
+		std::atomic<bool> ok(true);
+		auto decode = [&](size_t i){
+			SpanBuf rb(data[i], lengths[i]); std::istream cis(&rb); format(cis)=f; viewMode(cis)=vm; 
+			readRange(cis, v, i*per, i*per+std::min(per, n-i*per));
+			if (cis.fail()) ok = false;
+		};
+		for (size_t g=0, e=0; g<lengths.size() and ok; g=e) {
+			if (source) { 
+				for (; e<lengths.size(); e++) data[e] = view(is, lengths[e]);
+			} else {
+				uint64_t bytes = 0;
+				for (; e<lengths.size() and (e==g or bytes+lengths[e] <= (uint64_t(1)<<26)); e++) bytes += lengths[e];
+				readSized(is, buffer, bytes);
+				for (size_t i=g, o=0; i<e; o+=lengths[i++]) data[i] = &buffer[o];
+			}
+			if (not is) return;
+			v.resize(e==lengths.size() ? n : e*per);
+			if (isBitVector<V>::value) for (size_t i=g; i<e; i++) decode(i);
+			else parallelFor(e-g, [&](size_t i){ decode(g+i); });
+		}
+		if (not ok) is.setstate(std::ios_base::failbit);
+	}
+
+	// TAGGED FIELDS (see tagged)
+	static void writeFields(std::ostream &os) { pS(os,uint64_t(0)); }
+
+	// Each field is encoded once, into a buffer that is then copied (or only counted), so nesting does not repeat passes.
+	// Both start the field at offset 0, so padded Mats encode the same way in both.
+	template<class T, class... Rest>
+	static void writeFields(std::ostream &os, uint64_t tag, const T &v, Rest &&... rest) { 
+		pS(os,tag);
+		if (fixedSize<T>()) { 
+			pS(os,uint64_t(fixedSize<T>())); pS(os,v); 
+		} else if (SizeBuf *counter = dynamic_cast<SizeBuf *>(os.rdbuf())) { 
+			SizeBuf sb; std::ostream sos(&sb); format(sos)=format(os); pS(sos,v); 
+			pS(os,uint64_t(sb.size())); counter->add(sb.size()); 
+		} else { 
+			StringBuf sb; std::ostream sos(&sb); format(sos)=format(os); pS(sos,v); 
+			const std::string &s = sb.str(); pS(os,uint64_t(s.size())); os.write(s.data(), s.size()); 
+		}
+		writeFields(os,rest...); }
+
+	// Known fields are parsed from exactly their stored length, so a field whose encoding changed can not desync the rest
+	template<class T>
+	static void readBounded(std::istream &is, T &v, uint64_t length) {
+		SpanBuf *source = dynamic_cast<SpanBuf *>(is.rdbuf());
+		std::string buffer;
+		const char *p = nullptr;
+		if (source) p = view(is, length); else { readSized(is, buffer, length); p = buffer.data(); }
+		if (not is) return;
+		SpanBuf sb(p, length); std::istream fis(&sb); format(fis)=format(is); viewMode(fis)=(source?viewMode(is):0);
+		pU(fis,v);
+		if (fis.fail()) is.setstate(std::ios_base::failbit); }
+
+	static bool readField(std::istream &, uint64_t, uint64_t) { return false; }
+
+	template<class T, class... Rest>
+	static bool readField(std::istream &is, uint64_t length, uint64_t tag, uint64_t t, T &&v, Rest &&... rest) { 
+		if (tag!=t) return readField(is,length,tag,rest...); 
+		readBounded(is,v,length); return true; }
 
 	// IN-CLASS SERIALIZATIONS
 	template<class T, typename std::enable_if<std::is_void<decltype(std::declval<T>().serialize(*(new Reader()),0))>::value,int>::type=0> 
@@ -112,11 +469,39 @@ protected:
 //	template<class T, decltype(T().elemSize()) = 0>
 //	static void pS(std::ostream &os, const T &t) { pS(os,t.rows); pS(os,t.cols); os.write((char *)t.data, t.rows*t.cols*t.elemSize());}
 
+	// Bytes written so far into one of the buffers above, -1 for other stream buffers (whose tellp may be a syscall)
+	static std::streamoff written(std::ostream &os) {
+		std::streambuf *b = os.rdbuf();
+		if (SpanBuf   *s = dynamic_cast<SpanBuf   *>(b)) return s->written();
+		if (SizeBuf   *s = dynamic_cast<SizeBuf   *>(b)) return s->size();
+		if (StringBuf *s = dynamic_cast<StringBuf *>(b)) return s->size();
+		return -1;
+	}
+
+	// rows and cols are padded so that the elements are aligned for T relative to the start of the buffer being written
+	// (serialize, size, a tagged field or a chunk), never to a position in a file. The encoding is the same for size and 
+	// serialize. Other stream buffers get no padding. unserializeView copies Mats that end up misaligned in memory.
 	template<class T>
-	static void pS(std::ostream &os, const cv::Mat_<T> &t) { pS(os,t.rows); pS(os,t.cols); os.write((char *)t.data, t.rows*t.cols*t.elemSize());}
+	static void pS(std::ostream &os, const cv::Mat_<T> &t) { 
+		std::streamoff o = written(os);
+		size_t r = paddedSize(os,t.rows), c = paddedSize(os,t.cols), pad = (o<0 ? 0 : (alignof(T) - (o+r+c)%alignof(T))%alignof(T));
+		size_t cPad = (format(os)==BINARY ? std::min(pad, 10-c) : pad); // varints have at most 10 bytes
+		if (r+pad-cPad>10 and format(os)==BINARY) pad = cPad = 0;
+		pSPadded(os,t.rows,r+pad-cPad); pSPadded(os,t.cols,c+cPad); 
+		os.write((char *)t.data, t.rows*t.cols*t.elemSize());}
 	
 	template<class T>
-	static void pU(std::istream &is, cv::Mat_<T> &t) { int rows,cols; pU(is,rows); pU(is,cols); t.create(rows,cols); is.read((char *)t.data, t.rows*t.cols*t.elemSize());} 
+	static void pU(std::istream &is, cv::Mat_<T> &t) { int rows=0,cols=0; pU(is,rows); pU(is,cols); 
+		if (rows<0 or cols<0) is.setstate(std::ios_base::failbit);
+		if (not is) return;
+		if (not viewMode(is) and size_t(rows)*cols*sizeof(T) > available(is)) { // unknown remaining size, only allocate what arrives
+			std::string buffer; readSized(is, buffer, size_t(rows)*cols*sizeof(T));
+			if (is) { t.create(rows,cols); std::memcpy(t.data, buffer.data(), buffer.size()); }
+			return; }
+		if (not viewMode(is)) { t.create(rows,cols); is.read((char *)t.data, t.rows*t.cols*t.elemSize()); return; }
+		const char *p = view(is, size_t(rows)*cols*sizeof(T));
+		if (p and std::uintptr_t(p)%alignof(T)) { t.create(rows,cols); std::memcpy(t.data, p, size_t(rows)*cols*sizeof(T)); } // misaligned, copy
+		else if (p) t = cv::Mat_<T>(rows, cols, const_cast<T *>((const T *)p)); } // only reachable as const, see unserializeView
 
 	template<class T, int N>
 	static void pS(std::ostream &os, const cv::Vec<T, N> &t) { os.write((char *)&t, sizeof(cv::Vec<T, N>));}
@@ -132,18 +517,98 @@ protected:
 
 public:
 
+	// Serialized size when it is known at compile time, 0 when it depends on the value
+	template<class T> 
+	static constexpr size_t fixedSize() { return isRaw<T>::value?sizeof(T):0; }
+
+	// Writes straight into a stream, using the stream's format
 	template<class T, typename std::enable_if<std::is_void<decltype(Serializer::pS(*(std::ostringstream *)nullptr, *(T *)nullptr))>::value,int>::type=0> 
-	static std::string serialize(const T& t) { std::ostringstream oss; pS(oss,t); return oss.str(); }
+	static bool serialize(std::ostream &os, const T& t) { pS(os,t); return bool(os); }
+
+	// Exact number of bytes serialize(t,f) produces
+	template<class T, typename std::enable_if<std::is_void<decltype(Serializer::pS(*(std::ostringstream *)nullptr, *(T *)nullptr))>::value,int>::type=0> 
+	static size_t size(const T& t, Format f = TEXT) { 
+		if (fixedSize<T>()) return fixedSize<T>();
+		SizeBuf sb; std::ostream os(&sb); format(os)=f; pS(os,t); return sb.size(); }
+
+	// Writes into a caller provided buffer. Returns the bytes written, or 0 if it did not fit.
+	template<class T, typename std::enable_if<std::is_void<decltype(Serializer::pS(*(std::ostringstream *)nullptr, *(T *)nullptr))>::value,int>::type=0> 
+	static size_t serialize(const T& t, char *data, size_t capacity, Format f = TEXT) { SpanBuf sb(data, capacity); std::ostream os(&sb); format(os)=f; pS(os,t); return os?sb.written():0; }
+
+	template<class T, typename std::enable_if<std::is_void<decltype(Serializer::pS(*(std::ostringstream *)nullptr, *(T *)nullptr))>::value,int>::type=0> 
+	static std::string serialize(const T& t, Format f = TEXT) { std::string s(size(t,f),'\0'); serialize(t, &s[0], s.size(), f); return s; }
 
 	template<class T, typename std::enable_if<std::is_void<decltype(Serializer::pU(*(std::istringstream *)nullptr, *(T *)nullptr))>::value,int>::type=0> 
-	static T unserialize(const std::string &s) { std::istringstream iss(s); T t; unserialize(iss, t); return std::move(t); }
+	static bool unserialize(const char *data, size_t size, T& t, Format f = TEXT) { SpanBuf sb(data, size); std::istream is(&sb); format(is)=f; return unserialize(is, t) and not is.fail(); }
 
 	template<class T, typename std::enable_if<std::is_void<decltype(Serializer::pU(*(std::istringstream *)nullptr, *(T *)nullptr))>::value,int>::type=0> 
-	static bool unserialize(const std::string &s, T& t) { std::istringstream iss(s); return unserialize(iss, t); }
+	static T unserialize(const std::string &s, Format f = TEXT) { T t; unserialize(s.data(), s.size(), t, f); return t; }
+
+	template<class T, typename std::enable_if<std::is_void<decltype(Serializer::pU(*(std::istringstream *)nullptr, *(T *)nullptr))>::value,int>::type=0> 
+	static bool unserialize(const std::string &s, T& t, Format f = TEXT) { return unserialize(s.data(), s.size(), t, f); }
 
 	template<class T, typename std::enable_if<std::is_void<decltype(Serializer::pU(*(std::istringstream *)nullptr, *(T *)nullptr))>::value,int>::type=0> 
 	static bool unserialize(std::istream &is, T& t) { try { pU(is,t); return true; } catch (std::istream::failure) { return false; } }
 
+	// Zero copy unserialization: cv::Mat_ and std::string_view fields point into source instead of owning a copy, hence
+	// the const result. The returned pointer keeps source alive. Returns nullptr on failure. Mats are only copied when
+	// source was not written by serialize in one piece (their elements are aligned relative to the start of the stream).
+	template<class T, typename std::enable_if<std::is_void<decltype(Serializer::pU(*(std::istringstream *)nullptr, *(T *)nullptr))>::value,int>::type=0> 
+	static std::shared_ptr<const T> unserializeView(std::shared_ptr<const std::string> source, Format f = TEXT) { 
+		struct Holder { std::shared_ptr<const std::string> source; T t; };
+		auto h = std::make_shared<Holder>(); 
+		h->source = source;
+		SpanBuf sb(source->data(), source->size()); std::istream is(&sb); format(is)=f; viewMode(is)=1;
+		if (not unserialize(is, h->t) or is.fail()) return nullptr;
+		return std::shared_ptr<const T>(h, &h->t);
+	}
+
+	// Decodes only one chunk of a chunked vector. The preceding chunks are skipped without being parsed.
+	template<class T, class A>
+	static bool unserializeChunk(std::istream &is, size_t chunk, std::vector<T,A> &out) {
+		uint64_t n=0, per=0; 
+		std::vector<uint64_t> lengths;
+		pU(is,n); pU(is,per); pU(is,lengths);
+		if (not is or not validChunks<std::vector<T,A>>(n, per, lengths) or chunk>=lengths.size()) return false;
+		
+		uint64_t skip = 0; 
+		for (size_t i=0; i<chunk; i++) skip += lengths[i];
+		if (not is.seekg(skip, std::ios_base::cur)) { is.clear(); is.ignore(skip); }
+		
+		// The chunk bytes arrive before out grows
+		std::string buffer;
+		const char *p = nullptr;
+		if (dynamic_cast<SpanBuf *>(is.rdbuf())) p = view(is, lengths[chunk]); else { readSized(is, buffer, lengths[chunk]); p = buffer.data(); }
+		if (not is) return false;
+		SpanBuf rb(p, lengths[chunk]); std::istream cis(&rb); format(cis)=format(is);
+		out.resize(std::min(per, n-chunk*per));
+		readRange(cis, out, 0, out.size());
+		return not cis.fail();
+	}
+
+	template<class T, class A>
+	static bool unserializeChunk(const std::string &s, size_t chunk, std::vector<T,A> &out, Format f = TEXT) { 
+		SpanBuf sb(s.data(), s.size()); std::istream is(&sb); format(is)=f; return unserializeChunk(is, chunk, out); }
+
+	// Forward compatible serialize() body: { Serializer::tagged(ar, 1, a, 2, b, 3, c); }
+	// Each field is written as tag, byte length and payload, and the list is closed by tag 0. Readers skip tags they do not 
+	// know and leave fields missing from the data untouched. Tags must be non zero and never reused for a different type.
+	template<class... Fields> 
+	static void tagged(Reader &r, Fields &&... fields) { writeFields(*r.os, fields...); }
+
+	template<class... Fields> 
+	static void tagged(Writer &w, Fields &&... fields) {
+		std::istream &is = *w.is;
+		while (true) {
+			uint64_t tag=0, length=0; 
+			pU(is,tag); 
+			if (not tag or not is) break; 
+			pU(is,length); 
+			if (length > uint64_t(std::numeric_limits<std::streamsize>::max())) is.setstate(std::ios_base::failbit);
+			if (not is) break;
+			if (not readField(is,length,tag,fields...)) is.ignore(length); 
+		}
+	}
 };
 
 /*
@@ -260,12 +725,60 @@ public:
 	static bool unserialize(std::istream &is, T& t) { try { pU(is,t); return true; } catch (std::istream::failure) { return false; } }
 }*/
 
-struct Archive : public std::string {
+template<Serializer::Format F>
+struct Archive_ : public std::string {
 	
+	size_t cursor = 0; // Read position. Consumed bytes are dropped once they are the larger part of the archive.
+
 	using std::string::string;
-	Archive() {}
-	Archive(const std::string &s) {assign(s);}
-	template<typename T> Archive &operator<<(const T &t) { append(Serializer::serialize(t)); return *this;}
-	template<typename T> Archive &operator>>(T &t) { std::istringstream ss(*this); Serializer::unserialize(ss, t); assign(substr(ss.tellg())); return *this;}
+	Archive_() {}
+	Archive_(const std::string &s) {assign(s);}
+	size_t remaining() const { return size()-std::min(cursor, size()); } // bytes not read yet
+	template<typename T> Archive_ &operator<<(const T &t) { size_t o=size(), n=Serializer::size(t, F); resize(o+n); Serializer::serialize(t, &(*this)[o], n, F); return *this;}
+	template<typename T> Archive_ &operator>>(T &t) { 
+		cursor = std::min(cursor, size()); // in case the string was shrunk through its std::string interface
+		Serializer::SpanBuf sb(c_str()+cursor, size()-cursor); std::istream is(&sb); Serializer::format(is)=F; 
+		Serializer::unserialize(is, t); cursor += sb.consumed(); 
+		if (2*cursor>size()) { erase(0,cursor); cursor=0; }
+		return *this;}
 };
+
+typedef Archive_<Serializer::TEXT>   Archive;
+typedef Archive_<Serializer::BINARY> BinaryArchive;
+
+// Archive over a file or any other stream (e.g. a pipe). << writes through the stream buffer and >> reads sequentially, 
+// so memory use does not depend on the archive size. Reading past the end makes the archive evaluate to false.
+template<Serializer::Format F>
+class StreamArchive_ {
+	
+	std::vector<char> buffer;
+	std::unique_ptr<std::fstream> file;
+	std::ostream *os = nullptr;
+	std::istream *is = nullptr;
+
+public:
+	StreamArchive_(std::ostream &os) : os(&os) { Serializer::format(os)=F; }
+	StreamArchive_(std::istream &is) : is(&is) { Serializer::format(is)=F; }
+	StreamArchive_(std::iostream &s) : os(&s), is(&s) { Serializer::format(s)=F; }
+
+	// mode: std::ios::out (truncate), std::ios::app (append) or std::ios::in (read)
+	StreamArchive_(const std::string &filename, std::ios_base::openmode mode, size_t bufferSize = 1<<20) : buffer(bufferSize), file(new std::fstream) {
+		
+		file->rdbuf()->pubsetbuf(buffer.data(), buffer.size()); // must precede open
+		file->open(filename, mode | std::ios::binary);
+		Assert(file->is_open()) << "StreamArchive: could not open " << filename;
+		Serializer::format(*file)=F;
+		if (mode & (std::ios::out | std::ios::app)) os = file.get();
+		if (mode & std::ios::in) is = file.get();
+	}
+
+	template<typename T> StreamArchive_ &operator<<(const T &t) { Assert(os) << "StreamArchive: not writable"; Serializer::serialize(*os, t); return *this; }
+	template<typename T> StreamArchive_ &operator>>(T &t) { Assert(is) << "StreamArchive: not readable"; Serializer::unserialize(*is, t); return *this; }
+	
+	StreamArchive_ &flush() { if (os) os->flush(); return *this; }
+	explicit operator bool() const { return not ((os and os->fail()) or (is and is->fail())); }
+};
+
+typedef StreamArchive_<Serializer::TEXT>   StreamArchive;
+typedef StreamArchive_<Serializer::BINARY> BinaryStreamArchive;
 }
@@ -0,0 +1,220 @@
+////////////////////////////////////////////////////////////////////////
+// serializerBenchmark.hpp: throughput of Serializer round trips
+//
+// Manuel Martinez (manuel.martinez@kit.edu)
+//
+// license: LGPLv3
+//
+// Usage: int main() { uSnippets::SerializerBenchmark::runAll(); }
+// Define USNIPPETS_COUNT_ALLOCATIONS before including this header (in one translation unit only) to also count allocations.
+
+#pragma once
+#include <uSnippets/serializer.hpp>
+#include <opencv2/opencv.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <unordered_map>
+
+namespace uSnippets {
+
+struct SerializerBenchmark {
+
+	static std::atomic<size_t> &allocations() { static std::atomic<size_t> n(0); return n; }
+
+	struct Result {
+		std::string name;
+		Serializer::Format format;
+		size_t bytes;                      // serialized size of one payload
+		double writeMBs, readMBs;          // throughput, in serialized MB per second
+		double writeAllocs, readAllocs;    // allocations per operation, only with USNIPPETS_COUNT_ALLOCATIONS
+		bool ok;                           // the payload survives a round trip byte for byte
+	};
+
+	// Repeats each direction until about minBytes have been processed
+	template<class T>
+	static Result run(const std::string &name, const T &t, Serializer::Format f, size_t minBytes = 1<<26) {
+
+		typedef std::chrono::steady_clock Clock;
+
+		Result r;
+		r.name = name;
+		r.format = f;
+		std::string s = Serializer::serialize(t, f);
+		r.bytes = s.size();
+		size_t iterations = std::max(size_t(1), minBytes/std::max(size_t(1), s.size()));
+
+		size_t a0 = allocations();
+		auto t0 = Clock::now();
+		for (size_t i=0; i<iterations; i++) s = Serializer::serialize(t, f);
+		auto t1 = Clock::now();
+		size_t a1 = allocations();
+
+		T u;
+		for (size_t i=0; i<iterations; i++) Serializer::unserialize(s, u, f);
+		auto t2 = Clock::now();
+		size_t a2 = allocations();
+
+		double mb = double(s.size())*iterations/(1<<20);
+		r.writeMBs = mb/std::chrono::duration<double>(t1-t0).count();
+		r.readMBs  = mb/std::chrono::duration<double>(t2-t1).count();
+		r.writeAllocs = double(a1-a0)/iterations;
+		r.readAllocs  = double(a2-a1)/iterations;
+		r.ok = same(u, t, s, f);
+		return r;
+	}
+
+	// Same as run, reading through unserializeView (Mats point into the source instead of being copied)
+	template<class T>
+	static Result runView(const std::string &name, const T &t, Serializer::Format f, size_t minBytes = 1<<26) {
+
+		typedef std::chrono::steady_clock Clock;
+
+		Result r;
+		r.name = name;
+		r.format = f;
+		auto s = std::make_shared<const std::string>(Serializer::serialize(t, f));
+		r.bytes = s->size();
+		size_t iterations = std::max(size_t(1), minBytes/std::max(size_t(1), s->size()));
+
+		size_t a0 = allocations();
+		auto t0 = Clock::now();
+		for (size_t i=0; i<iterations; i++) Serializer::serialize(t, f);
+		auto t1 = Clock::now();
+		size_t a1 = allocations();
+
+		std::shared_ptr<const T> u;
+		for (size_t i=0; i<iterations; i++) u = Serializer::unserializeView<T>(s, f);
+		auto t2 = Clock::now();
+		size_t a2 = allocations();
+
+		double mb = double(s->size())*iterations/(1<<20);
+		r.writeMBs = mb/std::chrono::duration<double>(t1-t0).count();
+		r.readMBs  = mb/std::chrono::duration<double>(t2-t1).count();
+		r.writeAllocs = double(a1-a0)/iterations;
+		r.readAllocs  = double(a2-a1)/iterations;
+		r.ok = u and Serializer::serialize(*u, f) == *s;
+		return r;
+	}
+
+	// Round trips are checked byte for byte, except for hash maps whose iteration order may change when rebuilt
+	template<class T>
+	static bool same(const T &u, const T &, const std::string &s, Serializer::Format f) { return Serializer::serialize(u, f) == s; }
+	template<class K, class V>
+	static bool same(const std::unordered_map<K,V> &u, const std::unordered_map<K,V> &t, const std::string &, Serializer::Format) { return u == t; }
+
+	struct Item {
+		int id;
+		float score;
+		std::string label;
+		std::vector<cv::Vec3f> points;
+		template<class Archive> void serialize(Archive &ar, const uint) { ar & id & score & label & points; }
+	};
+
+	struct Pose { // copied as one block
+		float x, y, z, w;
+		int32_t id;
+		USNIPPETS_SERIALIZE_RAW(x, y, z, w, id);
+	};
+
+	struct ChunkedItems {
+		std::vector<Item> items;
+		template<class Archive> void serialize(Archive &ar, const uint) { ar & Serializer::chunked(items, 1<<10); }
+	};
+
+	struct TaggedItem {
+		int id;
+		std::string label;
+		std::vector<float> values;
+		template<class Archive> void serialize(Archive &ar, const uint) { Serializer::tagged(ar, 1, id, 2, label, 3, values); }
+	};
+
+	struct Frame {
+		std::string name;
+		cv::Mat_<float> image;
+		template<class Archive> void serialize(Archive &ar, const uint) { ar & name & image; }
+	};
+
+	static std::vector<Result> runAll(std::ostream &os = std::cout, size_t minBytes = 1<<26) {
+
+		std::vector<int> ints(1<<20);
+		for (size_t i=0; i<ints.size(); i++) ints[i] = int(i*2654435761u);
+
+		std::vector<double> doubles(1<<20);
+		for (size_t i=0; i<doubles.size(); i++) doubles[i] = i*0.5;
+
+		std::string text(1<<22, 'x');
+
+		std::vector<std::vector<int>> nested(1<<12, std::vector<int>(64, 12345));
+
+		std::map<std::string, int> dictionary;
+		for (int i=0; i<(1<<16); i++) dictionary["key"+std::to_string(i)] = i;
+
+		cv::Mat_<float> mat(1024, 1024);
+		for (int i=0; i<mat.rows; i++) for (int j=0; j<mat.cols; j++) mat(i,j) = i*j;
+
+		std::vector<cv::Vec3f> vecs(1<<18, cv::Vec3f(1,2,3));
+
+		std::vector<Item> items(1<<14);
+		for (size_t i=0; i<items.size(); i++) items[i] = Item{int(i), i*.1f, "item"+std::to_string(i), std::vector<cv::Vec3f>(i%16)};
+
+		std::vector<cv::Matx33f> matxs(1<<16, cv::Matx33f::eye());
+
+		std::vector<std::array<float,8>> arrays(1<<17);
+		for (size_t i=0; i<arrays.size(); i++) arrays[i].fill(i*.25f);
+
+		std::vector<std::pair<int,std::string>> pairs(1<<16);
+		for (size_t i=0; i<pairs.size(); i++) pairs[i] = std::make_pair(int(i), "value"+std::to_string(i));
+
+		std::unordered_map<std::string, int> hashed(dictionary.begin(), dictionary.end());
+
+		std::vector<Pose> poses(1<<17);
+		for (size_t i=0; i<poses.size(); i++) poses[i] = Pose{i*1.f, i*2.f, i*3.f, 1.f, int32_t(i)};
+
+		ChunkedItems chunked{items};
+
+		std::vector<TaggedItem> tagged(1<<14);
+		for (size_t i=0; i<tagged.size(); i++) tagged[i] = TaggedItem{int(i), "tag"+std::to_string(i), std::vector<float>(i%32, 1.5f)};
+
+		Frame frame{"frame", mat};
+
+		std::vector<Result> results;
+		for (auto f : {Serializer::TEXT, Serializer::BINARY}) {
+			results.push_back(run("vector<int>",         ints,       f, minBytes));
+			results.push_back(run("vector<double>",      doubles,    f, minBytes));
+			results.push_back(run("string",              text,       f, minBytes));
+			results.push_back(run("vector<vector<int>>", nested,     f, minBytes));
+			results.push_back(run("map<string,int>",     dictionary, f, minBytes));
+			results.push_back(run("Mat_<float>",         mat,        f, minBytes));
+			results.push_back(run("vector<Vec3f>",       vecs,       f, minBytes));
+			results.push_back(run("vector<Item>",        items,      f, minBytes));
+			results.push_back(run("vector<Matx33f>",     matxs,      f, minBytes));
+			results.push_back(run("vector<array<f,8>>",  arrays,     f, minBytes));
+			results.push_back(run("vector<pair<i,str>>", pairs,      f, minBytes));
+			results.push_back(run("unordered_map<s,i>",  hashed,     f, minBytes));
+			results.push_back(run("vector<raw Pose>",    poses,      f, minBytes));
+			results.push_back(run("chunked<Item>",       chunked,    f, minBytes));
+			results.push_back(run("vector<tagged>",      tagged,     f, minBytes));
+			results.push_back(runView("view Frame",      frame,      f, minBytes));
+		}
+
+		os << std::left << std::setw(22) << "payload" << std::setw(8) << "format" << std::right
+		   << std::setw(12) << "bytes" << std::setw(12) << "write MB/s" << std::setw(12) << "read MB/s"
+		   << std::setw(12) << "w allocs" << std::setw(12) << "r allocs" << "  ok\n";
+		for (auto &r : results)
+			os << std::left << std::setw(22) << r.name << std::setw(8) << (r.format==Serializer::TEXT?"text":"binary") << std::right << std::fixed << std::setprecision(1)
+			   << std::setw(12) << r.bytes << std::setw(12) << r.writeMBs << std::setw(12) << r.readMBs
+			   << std::setw(12) << r.writeAllocs << std::setw(12) << r.readAllocs << "  " << (r.ok?"yes":"NO") << "\n";
+		return results;
+	}
+};
+}
+
+#ifdef USNIPPETS_COUNT_ALLOCATIONS
+void *operator new(size_t sz) { uSnippets::SerializerBenchmark::allocations()++; if (void *p = std::malloc(sz?sz:1)) return p; throw std::bad_alloc(); }
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+#endif
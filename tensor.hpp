@@ -1,18 +1,256 @@
 #pragma once
 #include <opencv2/opencv.hpp>
 #include <pstreams/pstream.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
+#include <limits>
+#include <map>
 #include <memory>
+#include <sstream>
+#include <thread>
 #include <type_traits>
 #include <uSnippets/log.hpp>
+#include <uSnippets/parallel.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+#ifdef USEBLASGEMM
+extern "C" void sgemm_(const char *transa, const char *transb, const int *m, const int *n, const int *k, const float  *alpha, const float  *a, const int *lda, const float  *b, const int *ldb, const float  *beta, float  *c, const int *ldc);
+extern "C" void dgemm_(const char *transa, const char *transb, const int *m, const int *n, const int *k, const double *alpha, const double *a, const int *lda, const double *b, const int *ldb, const double *beta, double *c, const int *ldc);
+#endif
+
+#ifndef USNIPPETS_TENSOR_MAX_RANK
+#define USNIPPETS_TENSOR_MAX_RANK 8
+#endif
 
 namespace uSnippets {
 
-	
+template<typename T> class Tensor_;
+
+// How Tensor_ allocates memory, applies to the tensors allocated afterwards
+struct TensorAllocation {
+	bool hugePages = false;  // back allocations of 2MB or more with huge pages: MAP_HUGETLB if reserved, transparent ones otherwise
+	bool firstTouch = false; // zero new allocations from all threads, so on NUMA machines their pages spread over the nodes
+	static TensorAllocation &get() { static TensorAllocation a; return a; }
+};
+
+// 16 bit floating point element types. They only store the bits and convert to and from float, so tensors of them
+// take half the memory of Tensor1f while expressions and reductions over them compute in float.
+struct Half { // IEEE 754 binary16, rounds to nearest even
+	uint16_t bits;
+	Half() = default;
+	Half(float f) : bits(fromFloat(f)) {}
+	operator float() const { return toFloat(bits); }
+	static Half fromBits(uint16_t b) { Half h; h.bits = b; return h; }
+
+#ifdef __F16C__
+	static uint16_t fromFloat(float f) { return _cvtss_sh(f, 0); }
+	static float toFloat(uint16_t h) { return _cvtsh_ss(h); }
+#else
+	static uint16_t fromFloat(float f) {
+		uint32_t x; std::memcpy(&x, &f, 4);
+		uint32_t sign = (x>>16) & 0x8000, a = x & 0x7fffffff;
+		if (a >= 0x7f800000) return sign | 0x7c00 | (a>0x7f800000 ? 0x200 : 0); // inf and nan
+		if (a >= 0x477ff000) return sign | 0x7c00;                                // rounds above 65504
+		if (a <  0x38800000) { // subnormal, let the FPU round it by adding 0.5
+			float v; std::memcpy(&v, &a, 4); v += 0.5f; std::memcpy(&a, &v, 4);
+			return sign | (a - 0x3f000000);
+		}
+		return sign | ((a + 0xc8000fff + ((a>>13)&1)) >> 13); // rebias the exponent and round the mantissa
+	}
+	static float toFloat(uint16_t h) {
+		uint32_t x = uint32_t(h & 0x7fff) << 13, e = x & 0x0f800000;
+		if (e==0x0f800000) x += 0x70000000;                                   // inf and nan
+		else if (e) x += 0x38000000;
+		else { float v = float(h & 0x3ff) * (1.f/(1<<24)); std::memcpy(&x, &v, 4); } // subnormal
+		x |= uint32_t(h & 0x8000) << 16;
+		float f; std::memcpy(&f, &x, 4); return f;
+	}
+#endif
+};
+
+struct BFloat16 { // upper half of a float, rounds to nearest even
+	uint16_t bits;
+	BFloat16() = default;
+	BFloat16(float f) : bits(fromFloat(f)) {}
+	operator float() const { return toFloat(bits); }
+	static BFloat16 fromBits(uint16_t b) { BFloat16 h; h.bits = b; return h; }
+
+	static uint16_t fromFloat(float f) {
+		uint32_t x; std::memcpy(&x, &f, 4);
+		if ((x & 0x7fffffff) > 0x7f800000) return (x>>16) | 0x40; // keep nan quiet
+		return (x + 0x7fff + ((x>>16)&1)) >> 16;
+	}
+	static float toFloat(uint16_t b) { uint32_t x = uint32_t(b) << 16; float f; std::memcpy(&f, &x, 4); return f; }
+};
+
+// std::is_floating_point extended to the 16 bit types
+template<typename T> struct isFloat : std::is_floating_point<T> {};
+template<> struct isFloat<Half>     : std::true_type {};
+template<> struct isFloat<BFloat16> : std::true_type {};
+
+// Elementwise expressions are lazy and broadcast like NumPy: shapes are aligned to the right and size 1 dimensions stretch.
+// Nothing is computed until the expression is assigned to a Tensor_, which evaluates the whole tree in a single pass.
+namespace TensorExpr {
+
+	struct Node {};   // base of all expression nodes
+	struct Lookup {}; // empty base of Tensor_, so the operators and functions below are found by argument dependent lookup
+
+	// Walks one tensor operand. Strides are in bytes and get realigned to the destination before evaluation.
+	struct Cursor {
+		std::shared_ptr<const void> storage;
+		const char *p;
+		int64_t size;
+		std::vector<size_t> dims;
+		std::vector<int64_t> stride;
+
+		template<typename U> explicit Cursor(const Tensor_<U> &t);
+
+		void align(const std::vector<size_t> &shape) {
+			std::vector<int64_t> s(shape.size(), 0);
+			for (size_t d=0, off=shape.size()-dims.size(); d<dims.size(); d++)
+				if (dims[d]!=1) s[off+d] = stride[d];
+			stride = s;
+		}
+	};
+
+	static inline std::vector<size_t> broadcast(const std::vector<size_t> &a, const std::vector<size_t> &b) {
+		
+		std::vector<size_t> r(std::max(a.size(), b.size()), 1);
+		for (size_t i=1; i<=r.size(); i++) {
+			size_t x = (i<=a.size()?a[a.size()-i]:1), y = (i<=b.size()?b[b.size()-i]:1);
+			Assert(x==y or x==1 or y==1) << "shapes can not be broadcast " << x << " " << y;
+			r[r.size()-i] = (x==1?y:x);
+		}
+		return r;
+	}
+
+	// Drops size 1 dimensions and merges the ones that are contiguous for every cursor. Returns the new shape.
+	static inline std::vector<size_t> collapse(const std::vector<size_t> &shape, const std::vector<Cursor *> &cs) {
+		
+		std::vector<size_t> sz;
+		std::vector<std::vector<int64_t>> st(cs.size());
+		for (size_t d=0; d<shape.size(); d++) {
+			if (shape[d]==1) continue;
+			bool merge = not sz.empty();
+			for (size_t c=0; merge and c<cs.size(); c++) merge = (st[c].back() == cs[c]->stride[d]*int64_t(shape[d]));
+			if (merge) sz.back() *= shape[d]; else sz.push_back(shape[d]);
+			for (size_t c=0; c<cs.size(); c++) 
+				if (merge) st[c].back() = cs[c]->stride[d]; else st[c].push_back(cs[c]->stride[d]);
+		}
+		if (sz.empty()) { sz.push_back(1); for (auto &s : st) s.push_back(0); }
+		for (size_t c=0; c<cs.size(); c++) cs[c]->stride = st[c];
+		return sz;
+	}
+
+	// Calls f(n) for every innermost run of a collapsed shape, with all cursors pointing to its first element.
+	template<typename F>
+	static void walk(const std::vector<size_t> &sz, const std::vector<Cursor *> &cs, F f) {
+		
+		size_t k = sz.size();
+		std::vector<size_t> idx(k, 0);
+		while (true) {
+			f(sz[k-1]);
+			size_t d = k-1;
+			for (; d>0; d--) {
+				for (auto c : cs) c->p += c->stride[d-1];
+				if (++idx[d-1]<sz[d-1]) break;
+				for (auto c : cs) c->p -= c->stride[d-1]*int64_t(sz[d-1]);
+				idx[d-1] = 0;
+			}
+			if (d==0) return;
+		}
+	}
+
+	// Type elements are computed in: 16 bit floats are widened to float as they are read
+	template<typename U> struct Compute { typedef U type; };
+	template<> struct Compute<Half>     { typedef float type; };
+	template<> struct Compute<BFloat16> { typedef float type; };
+
+	// Nodes provide value_type, shape(), collect(cursors) and at<Unit>(i), the i-th element of the current innermost run.
+	template<typename U>
+	struct Leaf : Node, Cursor {
+		typedef typename Compute<U>::type value_type;
+		explicit Leaf(const Tensor_<U> &t) : Cursor(t) {}
+		std::vector<size_t> shape() const { return dims; }
+		void collect(std::vector<Cursor *> &c) { c.push_back(this); }
+		template<bool Unit> value_type at(size_t i) const { return Unit ? ((const U *)p)[i] : *(const U *)(p + int64_t(i)*stride.back()); }
+	};
+
+	template<typename U>
+	struct Scalar : Node {
+		typedef U value_type;
+		U v;
+		explicit Scalar(U v) : v(v) {}
+		std::vector<size_t> shape() const { return {}; }
+		void collect(std::vector<Cursor *> &) {}
+		template<bool> U at(size_t) const { return v; }
+	};
+
+	template<typename F, typename A>
+	struct Unary : Node {
+		typedef decltype(std::declval<F>()(std::declval<typename A::value_type>())) value_type;
+		F f; A a;
+		Unary(F f, A a) : f(f), a(a) {}
+		std::vector<size_t> shape() const { return a.shape(); }
+		void collect(std::vector<Cursor *> &c) { a.collect(c); }
+		template<bool Unit> value_type at(size_t i) const { return f(a.template at<Unit>(i)); }
+	};
+
+	template<typename F, typename A, typename B>
+	struct Binary : Node {
+		typedef decltype(std::declval<F>()(std::declval<typename A::value_type>(), std::declval<typename B::value_type>())) value_type;
+		F f; A a; B b;
+		Binary(F f, A a, B b) : f(f), a(a), b(b) {}
+		std::vector<size_t> shape() const { return broadcast(a.shape(), b.shape()); }
+		void collect(std::vector<Cursor *> &c) { a.collect(c); b.collect(c); }
+		template<bool Unit> value_type at(size_t i) const { return f(a.template at<Unit>(i), b.template at<Unit>(i)); }
+	};
+
+	// Operand<X>::make turns tensors and nodes into nodes; Arg<X,V> also turns arithmetic values into scalars.
+	// Scalars are promoted with the operand's values (an int tensor times 0.5 computes in double, t>0.5 is not t>0),
+	// except that float literals adopt a floating point operand's type, so float tensors are not widened by 0.5.
+	template<typename X> struct isExpr : std::is_base_of<Node, X> {};
+	template<typename U> struct isExpr<Tensor_<U>> : std::true_type {};
+
+	template<typename X, typename = void> struct Operand { typedef X type; static const X &make(const X &x) { return x; } };
+	template<typename U> struct Operand<Tensor_<U>> { typedef Leaf<U> type; static type make(const Tensor_<U> &t) { return type(t); } };
+
+	template<typename X, typename V, typename = void> struct Arg : Operand<X> {};
+	template<typename X, typename V> struct Arg<X, V, typename std::enable_if<std::is_arithmetic<X>::value>::type> { 
+		typedef typename std::conditional<std::is_floating_point<X>::value and isFloat<V>::value, V, typename std::common_type<X, V>::type>::type S;
+		typedef Scalar<S> type; 
+		static type make(X x) { return type(S(x)); } 
+	};
+
+	template<typename X, typename = void> struct ValueOf { typedef X type; };
+	template<typename X> struct ValueOf<X, typename std::enable_if<isExpr<X>::value>::type> { typedef typename Operand<X>::type::value_type type; };
+
+	template<typename X> using EnableUnary = typename std::enable_if<isExpr<X>::value>::type;
+	template<typename X, typename Y> using EnableBinary = typename std::enable_if<
+		(isExpr<X>::value or isExpr<Y>::value) and (isExpr<X>::value or std::is_arithmetic<X>::value) and (isExpr<Y>::value or std::is_arithmetic<Y>::value)>::type;
+
+	template<typename F, typename X, typename Y> struct BinaryOf {
+		typedef Arg<X, typename ValueOf<Y>::type> AX;
+		typedef Arg<Y, typename ValueOf<X>::type> AY;
+		typedef Binary<F, typename AX::type, typename AY::type> type;
+		static type make(const X &x, const Y &y) { return type(F(), AX::make(x), AY::make(y)); }
+	};
+}
 
 template<typename T>
-class Tensor_ {
+class Tensor_ : public TensorExpr::Lookup {
 protected: // Storage
 
 	struct Range { 
@@ -35,42 +273,78 @@ protected: // Storage
 	
 	struct Storage { // Always continuous 
 		cv::Mat_<T> M;
+		void *map = nullptr;
+		size_t mapSize = 0;
 		T * const data;
-		Storage(size_t sz) : data((T *)malloc(sizeof(T)*sz)) { Assert(sz) << "null allocation"; Assert (data) << "failed to allocate memory"; }
+		Storage(size_t sz) : data(allocate(sz)) {}
 		//Storage &resize(size_t sz) { data = realloc(data, sizeof(T)*sz); Assert(sz) << " null allocation"; Assert (data) << " failed to reallocate memory"; }
 		Storage(cv::Mat_<T> mat) : M(mat.isContinuous()?mat:mat.clone()), data(&M(0,0)) {} 
-		~Storage() { if (M.empty() and data) free(data);}
+		Storage(void *map, size_t mapSize, size_t offset) : map(map), mapSize(mapSize), data((T *)((char *)map + offset)) {}
+		~Storage() { if (map) munmap(map, mapSize); else if (M.empty() and data) free(data);}
+		
+		// 64 byte aligned, see TensorAllocation. Empty tensors own no memory.
+		T *allocate(size_t sz) {
+			
+			if (not sz) return nullptr;
+			const size_t huge = size_t(1)<<21, bytes = sz*sizeof(T);
+			void *p = nullptr;
+			if (TensorAllocation::get().hugePages and bytes>=huge) {
+#ifdef MAP_HUGETLB
+				mapSize = (bytes+huge-1)/huge*huge;
+				map = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+				p = map;
+#endif
+				if (p==nullptr or p==MAP_FAILED) { // no reserved huge pages, ask for transparent ones on a 2MB aligned range
+					mapSize = bytes+huge;
+					map = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+					Assert(map!=MAP_FAILED) << "failed to allocate memory";
+					p = (void *)(((uintptr_t)map+huge-1)/huge*huge);
+#ifdef MADV_HUGEPAGE
+					madvise(p, std::min((bytes+huge-1)/huge*huge, size_t((char *)map + mapSize - (char *)p)), MADV_HUGEPAGE); // within the mapping
+#endif
+				}
+			} else {
+				Assert(posix_memalign(&p, 64, bytes)==0) << "failed to allocate memory";
+			}
+			
+			if (TensorAllocation::get().firstTouch) {
+				size_t n = std::max(1u, std::thread::hardware_concurrency()), block = (bytes+n-1)/n;
+				parallelFor(n, [&](size_t t){ if (t*block<bytes) memset((char *)p + t*block, 0, std::min(block, bytes-t*block)); });
+			}
+			return (T *)p;
+		}
 	};
 
+	// View metadata lives inline, so views and indexing never allocate
+	static constexpr size_t MaxRank = USNIPPETS_TENSOR_MAX_RANK;
+
 	std::shared_ptr<Storage> storage;
-	std::shared_ptr<std::vector<size_t>> Sdims, Sstride0, Sstride1;
 	T *data, *pend;
-	size_t N, *dims, *stride0, *stride1;
+	size_t N, dims[MaxRank], stride0[MaxRank], stride1[MaxRank];
+
+	void setDimensions(const std::vector<size_t> &dimensions) {
+		N = dimensions.size();
+		Assert(N<=MaxRank) << "rank " << N << " exceeds USNIPPETS_TENSOR_MAX_RANK";
+		for (size_t i=0; i<N; i++) { dims[i] = dimensions[i]; stride0[i] = 0; stride1[i] = 1; }
+		for (size_t i=N-1; i and N; i--)
+			stride1[i-1] = stride1[i] * dims[i];
+	}
 
 protected: // Constructors
 	
 	Tensor_(std::initializer_list<size_t>) = delete;
 
-	explicit Tensor_(const std::vector<size_t> dimensions) :
-		Sdims   (std::make_shared<std::vector<size_t>>(dimensions)),
-		Sstride0(std::make_shared<std::vector<size_t>>(dimensions.size(),0)),
-		Sstride1(std::make_shared<std::vector<size_t>>(dimensions.size(),1)),
-		N(dimensions.size()),
-		dims(&Sdims->front()),
-		stride0(&Sstride0->front()),
-		stride1(&Sstride1->front())
-	{
-		Assert(N>0) << "called with dimension zero... might be worth to be considered at some point " << N;
-		
-		int nElem = 1;
+	explicit Tensor_(const std::vector<size_t> dimensions, std::shared_ptr<Storage> s = nullptr) : storage(s) {
+		
+		Assert(dimensions.size()>0) << "called with dimension zero... might be worth to be considered at some point " << dimensions.size();
+		setDimensions(dimensions);
+		
+		size_t nElem = 1;
 		for (size_t i=0; i<N; i++)
 			nElem *= dims[i];
 			
-		storage = std::make_shared<Storage>(nElem);
+		if (not storage) storage = std::make_shared<Storage>(nElem);
 		data = storage->data;
-		
-		for (size_t i=N-1; i; i--)
-			stride1[i-1] = stride1[i] * dims[i]; 
 	}
 		
 	
@@ -81,24 +355,17 @@ public: // Constructors
 		storage = std::make_shared<Storage>(mat);
 		data = storage->data;
 
-		Sdims = std::make_shared<std::vector<size_t>>();
+		std::vector<size_t> dimensions;
 		for (int i = (mat.dims==2 and mat.rows==1); i<mat.dims; i++) 
-			Sdims->push_back(mat.size[i]);
-
-		N = Sdims->size();
-		Sstride0 = std::make_shared<std::vector<size_t>>(N,0);
-		Sstride1 = std::make_shared<std::vector<size_t>>(N,1);
-
-		dims    = &Sdims->front();
-		stride0 = &Sstride0->front();
-		stride1 = &Sstride1->front();
-		
-		for (size_t i=N-1; i; i--)
-			stride1[i-1] = stride1[i] * dims[i];
+			dimensions.push_back(mat.size[i]);
+		setDimensions(dimensions);
 	}
 	
 	explicit Tensor_(cv::MatExpr && mate) : Tensor_(cv::Mat_<T>(mate)) {}
 
+	template<typename E, typename = typename std::enable_if<std::is_base_of<TensorExpr::Node, E>::value>::type>
+	explicit Tensor_(const E &e) : Tensor_(e.shape().empty() ? std::vector<size_t>(1, 1) : e.shape()) { evaluate(e, [](T &o, Compute v){ o = v; }); }
+
 	template<typename... Ts>
 	explicit Tensor_(size_t size, Ts ... t) : Tensor_(std::vector<size_t>({size, static_cast<size_t>(t)...})) {}
 	
@@ -120,13 +387,6 @@ protected: // Views and Accessors
 		Assert(v.size()==N) << "wrong number of dimensions while generating view";
 		
 		Tensor_ t = *this;
-		
-		t.Sdims    = std::make_shared<std::vector<size_t>>(*t.Sdims   );
-		t.Sstride0 = std::make_shared<std::vector<size_t>>(*t.Sstride0);
-		t.Sstride1 = std::make_shared<std::vector<size_t>>(*t.Sstride1);
-		t.dims     = &t.Sdims->front()    + (dims    - &(*Sdims)[0]);
-		t.stride0  = &t.Sstride0->front() + (stride0 - &(*Sstride0)[0]);
-		t.stride1  = &t.Sstride1->front() + (stride1 - &(*Sstride1)[0]);
 
 		for (size_t d=0; d<N; d++) {
 			Range r = (v[d]==Range()?Range(0, dims[d]):v[d]);
@@ -134,7 +394,7 @@ protected: // Views and Accessors
 
 			t.stride0[d] += t.stride1[d] * r.start;
 			t.stride1[d] *= r.step;
-			t.dims[d]     = std::abs(r.size());
+			t.dims[d]     = std::abs((r.end-r.start)/r.step);
 		}
 		return t;
 	}
@@ -149,9 +409,9 @@ protected: // Views and Accessors
 		Tensor_ t = *this;
 		t.N--;
 		t.data  = t.data + t.stride0[0] + t.stride1[0] * v;
-		t.dims++;
-		t.stride0++;
-		t.stride1++;
+		std::copy(dims+1,    dims+N,    t.dims);
+		std::copy(stride0+1, stride0+N, t.stride0);
+		std::copy(stride1+1, stride1+N, t.stride1);
 		
 		return t.viewP(rest...);
 	}
@@ -186,6 +446,192 @@ public: // Views and Accessors
 	
 	size_t nElem() const { size_t n=1; for (size_t d=0; d<N; d++) n*=dims[d]; return n; }
 
+public: // Reordering views, they only change metadata (except reshape of views that can not be reshaped in place)
+
+	Tensor_ permute(const std::vector<size_t> &order) {
+		
+		Assert(order.size()==N) << "wrong number of dimensions in permute " << order.size() << " " << N;
+		Tensor_ t = *this;
+		std::vector<bool> seen(N);
+		for (size_t d=0; d<N; d++) {
+			Assert(order[d]<N and not seen[order[d]]) << "permute needs a permutation of the dimensions";
+			seen[order[d]] = true;
+			t.dims[d] = dims[order[d]]; t.stride0[d] = stride0[order[d]]; t.stride1[d] = stride1[order[d]];
+		}
+		return t;
+	}
+
+	Tensor_ transpose(size_t a, size_t b) {
+		Assert(a<N and b<N) << "transpose out of range " << a << " " << b << " " << N;
+		std::vector<size_t> order(N);
+		for (size_t d=0; d<N; d++) order[d] = d;
+		std::swap(order[a], order[b]);
+		return permute(order);
+	}
+	Tensor_ transpose() { Assert(N>=2) << "transpose needs a matrix"; return transpose(N-2, N-1); }
+
+	// Removes one dimension of size 1, or all of them
+	Tensor_ squeeze(size_t axis) {
+		Assert(axis<N and dims[axis]==1) << "only dimensions of size 1 can be squeezed " << axis;
+		Tensor_ t = *this;
+		t.data += stride0[axis];
+		t.N--;
+		for (size_t d=axis; d<t.N; d++) { t.dims[d] = dims[d+1]; t.stride0[d] = stride0[d+1]; t.stride1[d] = stride1[d+1]; }
+		return t;
+	}
+	Tensor_ squeeze() { 
+		Tensor_ t = *this;
+		for (size_t d=N; d--;) if (t.dims[d]==1) t = t.squeeze(d);
+		return t;
+	}
+
+	// Inserts a dimension of size 1 before axis
+	Tensor_ unsqueeze(size_t axis) {
+		Assert(axis<=N and N<MaxRank) << "can not unsqueeze at " << axis << " with rank " << N;
+		Tensor_ t = *this;
+		t.N++;
+		for (size_t d=N; d>axis; d--) { t.dims[d] = dims[d-1]; t.stride0[d] = stride0[d-1]; t.stride1[d] = stride1[d-1]; }
+		t.dims[axis] = 1; 
+		t.stride0[axis] = 0; 
+		t.stride1[axis] = (axis<N ? dims[axis]*stride1[axis] : 1); // keeps continuous tensors continuous
+		return t;
+	}
+
+	// Same elements in row-major order with new dimensions. A view when the strides allow it, a copy otherwise.
+	Tensor_ reshape(const std::vector<size_t> &newDims) {
+		
+		size_t n = 1;
+		for (auto d : newDims) n *= d;
+		Assert(n==nElem() and newDims.size()<=MaxRank and not newDims.empty()) << "can not reshape " << nElem() << " elements into " << n;
+		if (not n) return Tensor_(newDims); // nothing to share, and zero sized groups can not be matched
+		
+		Tensor_ t = *this;
+		t.data = origin();
+		t.N = newDims.size();
+		for (size_t d=0; d<t.N; d++) { t.dims[d] = newDims[d]; t.stride0[d] = 0; t.stride1[d] = 1; }
+		
+		// Match groups of old dimensions with groups of new ones holding the same number of elements, as NumPy does.
+		// Each group of old dimensions must be contiguous, the new dimensions of the group then get strides from its last one.
+		std::vector<size_t> od; 
+		std::vector<int64_t> os;
+		for (size_t d=0; d<N; d++) if (dims[d]!=1) { od.push_back(dims[d]); os.push_back(stride1[d]); }
+		size_t oi = 0, oj = 1, ni = 0, nj = 1;
+		bool ok = true;
+		while (ok and ni<t.N and oi<od.size()) {
+			size_t np = t.dims[ni], op = od[oi];
+			while (np!=op) {
+				if (np<op) np *= t.dims[nj++]; 
+				else       op *= od[oj++];
+			}
+			for (size_t k=oi; k+1<oj; k++) ok = ok and os[k]==int64_t(od[k+1])*os[k+1];
+			t.stride1[nj-1] = os[oj-1];
+			for (size_t k=nj-1; k>ni; k--) t.stride1[k-1] = t.stride1[k]*t.dims[k];
+			ni = nj++; 
+			oi = oj++;
+		}
+		if (ok) return t;
+		return contiguous().reshape(newDims);
+	}
+	template<typename... Ts> Tensor_ reshape(size_t d, Ts... rest) { return reshape(std::vector<size_t>({d, static_cast<size_t>(rest)...})); }
+
+	const Tensor_ permute(const std::vector<size_t> &order) const { return const_cast<Tensor_ *>(this)->permute(order); }
+	const Tensor_ transpose(size_t a, size_t b)             const { return const_cast<Tensor_ *>(this)->transpose(a, b); }
+	const Tensor_ transpose()                               const { return const_cast<Tensor_ *>(this)->transpose(); }
+	const Tensor_ squeeze(size_t axis)                      const { return const_cast<Tensor_ *>(this)->squeeze(axis); }
+	const Tensor_ squeeze()                                 const { return const_cast<Tensor_ *>(this)->squeeze(); }
+	const Tensor_ unsqueeze(size_t axis)                    const { return const_cast<Tensor_ *>(this)->unsqueeze(axis); }
+	const Tensor_ reshape(const std::vector<size_t> &d)     const { return const_cast<Tensor_ *>(this)->reshape(d); }
+	template<typename... Ts> const Tensor_ reshape(size_t d, Ts... rest) const { return const_cast<Tensor_ *>(this)->reshape(d, rest...); }
+
+	// This tensor if already continuous, otherwise a row-major copy. When the fastest axis of the view is not the last one
+	// (permuted views) the copy goes through square tiles, so both reads and writes stay within cached lines.
+	Tensor_ contiguous() const {
+		
+		if (isContinuous()) return const_cast<Tensor_ &>(*this);
+		Tensor_ c(dimensions());
+		
+		size_t a = N-1, b = N-1, B = 64;
+		for (size_t d=0; d<N; d++) 
+			if (dims[d]>1 and std::abs(int64_t(stride1[d])) < std::abs(int64_t(stride1[a]))) a = d;
+		if (a==b or dims[b]==1) { c.view() = *this; return c; }
+		
+		std::vector<size_t> outer;
+		for (size_t d=0; d<N; d++) if (d!=a and d!=b) outer.push_back(d);
+		size_t nOuter = 1;
+		for (auto d : outer) nOuter *= dims[d];
+		size_t tilesA = (dims[a]+B-1)/B, tilesB = (dims[b]+B-1)/B;
+		int64_t sa = stride1[a], sb = stride1[b];
+		size_t da = c.stride1[a];
+		const T *src = origin();
+		
+		auto tile = [&](size_t t){
+			size_t o = t/(tilesA*tilesB), ta = (t/tilesB)%tilesA, tb = t%tilesB;
+			const T *s = src; 
+			T *dst = c.data;
+			for (size_t k=outer.size(); k--; o/=dims[outer[k]]) { 
+				size_t i = o%dims[outer[k]]; 
+				s += int64_t(i)*int64_t(stride1[outer[k]]); 
+				dst += i*c.stride1[outer[k]]; 
+			}
+			for (size_t j=tb*B; j<std::min(dims[b], (tb+1)*B); j++)
+				for (size_t i=ta*B; i<std::min(dims[a], (ta+1)*B); i++)
+					dst[i*da + j] = s[int64_t(i)*sa + int64_t(j)*sb];
+		};
+		size_t nTiles = nOuter*tilesA*tilesB;
+		if (nElem() < (size_t(1)<<16)) for (size_t t=0; t<nTiles; t++) tile(t);
+		else parallelFor(nTiles, tile);
+		return c;
+	}
+
+public: // Element type conversion
+
+	// Returns a continuous copy of v*scale+shift as U. The arithmetic is done in float, or in double if either type is double.
+	// Results saturate: integers are rounded to nearest and clamped to the range of U, floats are clamped to its finite range.
+	template<typename U>
+	Tensor_<U> convert(double scale = 1, double shift = 0) const {
+		
+		typedef typename std::conditional<std::is_same<T, double>::value or std::is_same<U, double>::value, double, float>::type W;
+		Tensor_<U> out(N ? dimensions() : std::vector<size_t>(1, 1));
+		const W a = W(scale), b = W(shift);
+		const bool identity = scale==1 and shift==0;
+		
+		auto run = [a, b, identity](U *o, const T *p, size_t n, int64_t so, int64_t sp) {
+			if (so==1 and sp==1 and identity) for (size_t i=0; i<n; i++) o[i] = saturate<U>(W(p[i]));
+			else if (so==1 and sp==1)         for (size_t i=0; i<n; i++) o[i] = saturate<U>(W(p[i])*a + b);
+			else for (size_t i=0; i<n; i++, o+=so, p+=sp) *o = saturate<U>(W(*p)*a + b);
+		};
+		
+		// large tensors are split in blocks of elements if continuous, or along the first dimension otherwise
+		const size_t n = nElem(), block = size_t(1)<<16;
+		if (n<block) {
+			Tensor_<U>::forEachRun(out, *this, run);
+		} else if (isContinuous()) {
+			const T *p = origin();
+			parallelFor((n+block-1)/block, [&](size_t t){ run(out.data + t*block, p + t*block, std::min(block, n-t*block), 1, 1); });
+		} else {
+			size_t rows = std::max(size_t(1), block/(n/dims[0])), nRows = dims[0];
+			parallelFor((nRows+rows-1)/rows, [&](size_t t){
+				std::vector<Range> r(N); 
+				std::vector<typename Tensor_<U>::Range> ro(N);
+				r[0] = Range(t*rows, std::min(nRows, (t+1)*rows));
+				ro[0] = typename Tensor_<U>::Range(r[0].start, r[0].end);
+				Tensor_<U>::forEachRun(out.viewP(ro), const_cast<Tensor_ *>(this)->viewP(r), run);
+			});
+		}
+		return out;
+	}
+
+	// v rounded and clamped to the range of U, nan becomes 0 for integer types and stays nan otherwise
+	template<typename U, typename W>
+	static U saturate(W v) {
+		if (std::is_integral<U>::value) {
+			v = std::nearbyint(v);
+			return v >= W(std::numeric_limits<U>::max()) ? std::numeric_limits<U>::max() : v <= W(std::numeric_limits<U>::lowest()) ? std::numeric_limits<U>::lowest() : v==v ? U(v) : U(0);
+		}
+		const W hi = W(std::numeric_limits<U>::max());
+		return U(v > hi ? hi : v < -hi ? -hi : v);
+	}
+
 protected: // Methods
 	
 	friend std::ostream & operator<<(std::ostream &os, const Tensor_& t) {
@@ -236,15 +682,334 @@ protected: // Methods
 	}
 	
 
+protected: // Flat strided kernels
+
+	T *origin() const { T *p = data; for (size_t d=0; d<N; d++) p += stride0[d]; return p; } // address of element (0,...,0)
+
+	// Calls f(pa, pb, n, sa, sb) for every innermost run of n elements of a and b, which must have the same dimensions.
+	// Dimensions that are laid out contiguously in both tensors are merged first, so continuous tensors are a single run.
+	template<typename U, typename F>
+	static void forEachRun(const Tensor_ &a, const Tensor_<U> &b, F f) {
+		
+		std::vector<size_t> sz;
+		std::vector<int64_t> sa, sb;
+		for (size_t d=0; d<a.N; d++) {
+			if (a.dims[d]==0) return;
+			if (a.dims[d]==1) continue;
+			if (not sz.empty() and sa.back()==int64_t(a.dims[d]*a.stride1[d]) and sb.back()==int64_t(b.dims[d]*b.stride1[d])) {
+				sz.back() *= a.dims[d]; sa.back() = a.stride1[d]; sb.back() = b.stride1[d];
+			} else {
+				sz.push_back(a.dims[d]); sa.push_back(a.stride1[d]); sb.push_back(b.stride1[d]);
+			}
+		}
+		if (sz.empty()) { sz.push_back(1); sa.push_back(1); sb.push_back(1); }
+		
+		size_t k = sz.size();
+		std::vector<size_t> idx(k, 0);
+		T *pa = a.origin(); 
+		U *pb = b.origin();
+		while (true) {
+			f(pa, pb, sz[k-1], sa[k-1], sb[k-1]);
+			size_t d = k-1;
+			for (; d>0; d--) {
+				pa += sa[d-1]; pb += sb[d-1];
+				if (++idx[d-1]<sz[d-1]) break;
+				pa -= sa[d-1]*int64_t(sz[d-1]); pb -= sb[d-1]*int64_t(sz[d-1]); idx[d-1] = 0;
+			}
+			if (d==0) return;
+		}
+	}
+
+	template<typename U> friend class Tensor_;
+	friend struct TensorExpr::Cursor;
+
+	typedef typename TensorExpr::Compute<T>::type Compute;
+
+	// Evaluates an expression (or a scalar) broadcast to the shape of this tensor, calling f(element, value) once per element.
+	// Values are passed in the Compute type, so compound assignments to 16 bit tensors round only once.
+	// The unit stride loop is kept free of stride arithmetic so the compiler can vectorize it.
+	template<typename E, typename F>
+	Tensor_ &evaluate(const E &expr, F f) {
+		
+		typedef TensorExpr::Arg<E, Compute> Arg;
+		typename Arg::type e = Arg::make(expr); // own copy, its cursors are moved during the walk
+		std::vector<TensorExpr::Cursor *> cursors;
+		e.collect(cursors);
+
+		TensorExpr::Cursor out(*this);
+		for (auto c : cursors) 
+			if (c->storage == out.storage and (c->p != out.p or c->dims != out.dims or c->stride != out.stride))
+				return evaluate(Tensor_<typename Arg::type::value_type>(e), f); // overlapping operand with a different layout
+		
+		std::vector<size_t> shape = dimensions();
+		if (shape.empty()) shape.push_back(1);
+		Assert(TensorExpr::broadcast(e.shape(), shape) == shape) << "expression can not be broadcast into the destination";
+		if (nElem()==0) return *this;
+		
+		cursors.push_back(&out);
+		for (auto c : cursors) c->align(shape);
+		std::vector<size_t> sz = TensorExpr::collapse(shape, cursors);
+
+		bool unit = true;
+		for (auto c : cursors) unit = unit and c->stride.back()==c->size;
+		
+		int64_t so = out.stride.back()/int64_t(sizeof(T));
+		TensorExpr::walk(sz, cursors, [&](size_t n){
+			T *o = (T *)out.p;
+			if (unit) for (size_t i=0; i<n; i++) f(o[i],    Compute(e.template at<true >(i)));
+			else      for (size_t i=0; i<n; i++) f(o[i*so], Compute(e.template at<false>(i)));
+		});
+		return *this;
+	}
+
+protected: // Reductions
+
+	typedef typename std::conditional<std::is_integral<T>::value, int64_t, double>::type Wide;
+
+	// Reducers provide init(), step(accumulator, value, index), merge(accumulator, accumulator) and done(accumulator, count)
+	template<typename V>
+	struct SumR {
+		typedef Wide accumulator; typedef V result_type; bool mean;
+		accumulator init() const { return 0; }
+		void step(accumulator &a, T v, size_t) const { a += v; }
+		void merge(accumulator &a, const accumulator &b) const { a += b; }
+		V done(const accumulator &a, size_t n) const { return mean ? V(double(a)/n) : V(a); }
+	};
+
+	struct NormR {
+		typedef Wide accumulator; typedef typename std::conditional<std::is_integral<T>::value, double, T>::type result_type;
+		accumulator init() const { return 0; }
+		void step(accumulator &a, T v, size_t) const { a += Wide(v)*v; }
+		void merge(accumulator &a, const accumulator &b) const { a += b; }
+		result_type done(const accumulator &a, size_t) const { return result_type(std::sqrt(double(a))); }
+	};
+
+	template<bool Max>
+	struct ExtremeR {
+		typedef T accumulator; typedef T result_type;
+		accumulator init() const { return Max ? std::numeric_limits<T>::lowest() : std::numeric_limits<T>::max(); }
+		void step(accumulator &a, T v, size_t) const { a = ((Max ? a<v : v<a) ? v : a); }
+		void merge(accumulator &a, const accumulator &b) const { step(a, b, 0); }
+		T done(const accumulator &a, size_t) const { return a; }
+	};
+
+	template<bool Max>
+	struct ArgR { // ties resolve to the lowest index
+		struct accumulator { T v; size_t k; };
+		typedef int result_type;
+		accumulator init() const { return { Max ? std::numeric_limits<T>::lowest() : std::numeric_limits<T>::max(), 0 }; }
+		void step(accumulator &a, T v, size_t k) const { if (Max ? a.v<v : v<a.v) a = {v, k}; }
+		void merge(accumulator &a, const accumulator &b) const { if ((Max ? a.v<b.v : b.v<a.v) or (a.v==b.v and b.k<a.k)) a = b; }
+		int done(const accumulator &a, size_t) const { return int(a.k); }
+	};
+
+	// The result drops the reduced axis. When the axis has the smallest stride each output element reduces one run,
+	// split into 8 independent lanes so the loop vectorizes; otherwise whole output rows are accumulated at once,
+	// walking the input in memory order. Work is split among threads by output rows and, when there are too few
+	// rows to keep all cores busy, also along the reduced axis, merging the partial accumulators at the end.
+	template<typename R>
+	Tensor_<typename R::result_type> reduce(size_t axis, R r) const {
+		
+		Assert(axis<N) << "reduction axis out of range " << axis << " " << N;
+		typedef typename R::accumulator A;
+		typedef typename R::result_type V;
+		
+		std::vector<size_t> rdims;
+		std::vector<int64_t> rstride;
+		for (size_t d=0; d<N; d++) {
+			if (d==axis) continue;
+			if (not rdims.empty() and rstride.back()==int64_t(dims[d]*stride1[d])) { 
+				rdims.back() *= dims[d]; rstride.back() = stride1[d]; // contiguous in the input, output order is unchanged
+			} else { 
+				rdims.push_back(dims[d]); rstride.push_back(stride1[d]); 
+			}
+		}
+		if (rdims.empty()) { rdims.push_back(1); rstride.push_back(0); }
+		
+		std::vector<size_t> odims;
+		for (size_t d=0; d<N; d++) if (d!=axis) odims.push_back(dims[d]);
+		Tensor_<V> out(odims.empty() ? std::vector<size_t>(1, 1) : odims);
+		if (not out.nElem()) return out;
+		
+		const T *p0 = origin();
+		size_t L = dims[axis], row = rdims.back(), nOut = out.nElem(), rows = nOut/row;
+		int64_t sa = int64_t(stride1[axis]), sl = rstride.back();
+		bool alongRun = (row==1 or std::abs(sa) <= std::abs(sl));
+		
+		size_t nThreads = std::max(1u, std::thread::hardware_concurrency());
+		size_t rowsPerChunk = std::max(size_t(1), (size_t(1)<<16)/std::max(size_t(1), row*L));
+		size_t nChunks = (rows+rowsPerChunk-1)/rowsPerChunk, nBlocks = 1;
+		if (nChunks < 4*nThreads and L >= 2048) nBlocks = std::min(L/1024, (4*nThreads+nChunks-1)/nChunks);
+		std::vector<A> partial(nBlocks>1 ? nBlocks*nOut : 0);
+		
+		auto rowStart = [&](size_t i) {
+			const T *p = p0;
+			for (size_t d=rdims.size()-1; d--; i/=rdims[d]) p += int64_t(i%rdims[d])*rstride[d];
+			return p;
+		};
+		
+		auto run = [&](const T *p, size_t k, size_t kEnd) {
+			A a[8]; 
+			for (auto &x : a) x = r.init();
+			if (sa==1) for (; k+8<=kEnd; k+=8) for (size_t j=0; j<8; j++) r.step(a[j], p[k+j], k+j);
+			for (; k<kEnd; k++) r.step(a[0], p[int64_t(k)*sa], k);
+			for (size_t j=1; j<8; j++) r.merge(a[0], a[j]);
+			return a[0];
+		};
+
+		parallelFor(nChunks*nBlocks, [&](size_t t){
+			size_t c = t/nBlocks, b = t%nBlocks, k0 = b*L/nBlocks, k1 = (b+1)*L/nBlocks;
+			std::vector<A> acc(row);
+			for (size_t i=c*rowsPerChunk; i<std::min(rows, (c+1)*rowsPerChunk); i++) {
+				const T *p = rowStart(i);
+				if (alongRun) {
+					for (size_t j=0; j<row; j++) acc[j] = run(p + int64_t(j)*sl, k0, k1);
+				} else {
+					std::fill(acc.begin(), acc.end(), r.init());
+					for (size_t k=k0; k<k1; k++) {
+						const T *q = p + int64_t(k)*sa;
+						if (sl==1) for (size_t j=0; j<row; j++) r.step(acc[j], q[j],               k);
+						else       for (size_t j=0; j<row; j++) r.step(acc[j], q[int64_t(j)*sl], k);
+					}
+				}
+				if (nBlocks>1) std::copy(acc.begin(), acc.end(), partial.begin() + b*nOut + i*row);
+				else for (size_t j=0; j<row; j++) out.data[i*row+j] = r.done(acc[j], L);
+			}
+		});
+		
+		for (size_t e=0; nBlocks>1 and e<nOut; e++) {
+			for (size_t b=1; b<nBlocks; b++) r.merge(partial[e], partial[b*nOut+e]);
+			out.data[e] = r.done(partial[e], L);
+		}
+		return out;
+	}
+
+protected: // Matrix multiplication
+
+	// Strided m x k matrix: element (i,j) is at p[i*rs + j*cs]
+	struct Matrix { const T *p; int64_t rs, cs; };
+
+	static constexpr size_t MR = 4, NR = 64/sizeof(T), MC = 64, KC = 256, NC = 512;
+
+	// c(mr x nr, row stride rc) += a(packed MR x kc) * b(packed kc x NR)
+	// One row at a time keeps the NR accumulators in vector registers; the layout is what GCC vectorizes best at -O2 and -O3.
+	static void microKernel(size_t kc, const T *a, const T *b, T *c, size_t rc, size_t mr, size_t nr) {
+		for (size_t i=0; i<mr; i++) {
+			T acc[NR] = {};
+			for (size_t p=0; p<kc; p++)
+				for (size_t j=0; j<NR; j++)
+					acc[j] += a[p*MR+i]*b[p*NR+j];
+			for (size_t j=0; j<nr; j++) 
+				c[i*rc+j] += acc[j];
+		}
+	}
+
+	// Copies the block into panels of R rows (or columns if transposed), laid out as consumed by microKernel, zero padded
+	template<size_t R>
+	static void pack(T *buf, Matrix A, size_t r0, size_t nr, size_t c0, size_t nc, bool transposed) {
+		if (transposed) { std::swap(A.rs, A.cs); std::swap(r0, c0); std::swap(nr, nc); }
+		for (size_t i=0; i<nr; i+=R)
+			for (size_t p=0; p<nc; p++)
+				for (size_t j=0; j<R; j++)
+					*buf++ = (i+j<nr ? A.p[int64_t(r0+i+j)*A.rs + int64_t(c0+p)*A.cs] : T(0));
+	}
+
+	// C(m x n, contiguous) += A(m x k) * B(k x n), for rows [i0,i0+mc) and columns [j0,j0+nc) of C
+	static void gemmBlock(Matrix A, Matrix B, T *C, size_t n, size_t k, size_t i0, size_t mc, size_t j0, size_t nc) {
+		
+		std::vector<T> Ap(((mc+MR-1)/MR)*MR*std::min(k, size_t(KC))), Bp(((nc+NR-1)/NR)*NR*std::min(k, size_t(KC)));
+		for (size_t p0=0; p0<k; p0+=KC) {
+			size_t kc = std::min(size_t(KC), k-p0);
+			pack<MR>(&Ap[0], A, i0, mc, p0, kc, false);
+			pack<NR>(&Bp[0], B, p0, kc, j0, nc, true);
+			for (size_t j=0; j<nc; j+=NR)
+				for (size_t i=0; i<mc; i+=MR)
+					microKernel(kc, &Ap[i*kc], &Bp[j*kc], C + (i0+i)*n + j0+j, n, std::min(size_t(MR), mc-i), std::min(size_t(NR), nc-j));
+		}
+	}
+
+#ifdef USEBLASGEMM
+	static void gemm(const char *ta, const char *tb, int m, int n, int k, const float  *a, int lda, const float  *b, int ldb, float  *c, int ldc) { float  one=1; sgemm_(ta, tb, &m, &n, &k, &one, a, &lda, b, &ldb, &one, c, &ldc); }
+	static void gemm(const char *ta, const char *tb, int m, int n, int k, const double *a, int lda, const double *b, int ldb, double *c, int ldc) { double one=1; dgemm_(ta, tb, &m, &n, &k, &one, a, &lda, b, &ldb, &one, c, &ldc); }
+
+	// Column major BLAS computes C^T = B^T A^T. Any operand with a unit stride in either direction can be passed as is.
+	static bool blas(Matrix A, Matrix B, T *C, size_t m, size_t n, size_t k) {
+		
+		auto layout = [](Matrix X, size_t rows, size_t cols, const char *&t, int &ld) {
+			if (X.cs==1 and X.rs>=int64_t(std::max(size_t(1), cols))) { t = "N"; ld = int(X.rs); return true; }
+			if (X.rs==1 and X.cs>=int64_t(std::max(size_t(1), rows))) { t = "T"; ld = int(X.cs); return true; }
+			return false;
+		};
+		const char *ta, *tb; int lda, ldb;
+		if (not layout(B, k, n, ta, lda) or not layout(A, m, k, tb, ldb)) return false;
+		gemm(ta, tb, int(n), int(m), int(k), B.p, lda, A.p, ldb, C, int(n));
+		return true;
+	}
+#endif
+
+public: // Matrix multiplication
+
+	// Multiplies the last two dimensions (m x k by k x n), batched over the leading ones, which broadcast like NumPy.
+	// Operands can be any strided views; they are read in cache sized blocks, never copied whole.
+	// Define USEBLASGEMM to hand every batch item with a unit stride layout to an external sgemm_/dgemm_.
+	Tensor_ matmul(const Tensor_ &b) const {
+		
+		static_assert(std::is_floating_point<T>::value, "matmul needs a float or double tensor, convert 16 bit ones first");
+		Assert(N>=2 and b.N>=2) << "matmul needs matrices " << N << " " << b.N;
+		size_t m = dims[N-2], k = dims[N-1], n = b.dims[b.N-1];
+		Assert(b.dims[b.N-2]==k) << "inner dimensions do not match in matmul " << k << " " << b.dims[b.N-2];
+		
+		std::vector<size_t> batch = TensorExpr::broadcast(std::vector<size_t>(dims, dims+N-2), std::vector<size_t>(b.dims, b.dims+b.N-2));
+		std::vector<size_t> odims = batch;
+		odims.push_back(m); 
+		odims.push_back(n);
+		Tensor_ c(odims);
+		if (not c.nElem()) return c;
+		c.view() = T(0);
+		if (not k) return c;
+		
+		size_t nBatch = c.nElem()/std::max(size_t(1), m*n);
+		auto matrix = [&](const Tensor_ &t, size_t i) {
+			Matrix X{ t.origin(), int64_t(t.stride1[t.N-2]), int64_t(t.stride1[t.N-1]) };
+			for (size_t d=batch.size(), e=t.N-2; d-- and e--; i/=batch[d]) 
+				if (t.dims[e]!=1) X.p += int64_t(i%batch[d])*int64_t(t.stride1[e]);
+			return X;
+		};
+		
+#ifdef USEBLASGEMM
+		bool useBlas = true;
+		for (size_t i=0; useBlas and i<nBatch; i++) useBlas = blas(matrix(*this, i), matrix(b, i), c.data + i*m*n, m, n, k);
+		if (useBlas) return c;
+		c.view() = T(0);
+#endif
+		size_t mBlocks = (m+MC-1)/MC, nBlocks = (n+NC-1)/NC;
+		parallelFor(nBatch*mBlocks*nBlocks, [&](size_t t){
+			size_t i = t/(mBlocks*nBlocks), ib = (t/nBlocks)%mBlocks, jb = t%nBlocks;
+			gemmBlock(matrix(*this, i), matrix(b, i), c.data + i*m*n, n, k, ib*MC, std::min(size_t(MC), m-ib*MC), jb*NC, std::min(size_t(NC), n-jb*NC));
+		});
+		return c;
+	}
+
+public: // Reductions along one axis, which is removed from the result
+
+	// Integer sums are returned as int64_t so they do not wrap, integer means and norms as double so they are not truncated
+	typedef typename std::conditional<std::is_integral<T>::value, int64_t, T>::type SumType;
+	typedef typename std::conditional<std::is_integral<T>::value, double,  T>::type MeanType;
+
+	Tensor_<SumType>  sum (size_t axis) const { return reduce(axis, SumR<SumType>{false}); }
+	Tensor_<MeanType> mean(size_t axis) const { return reduce(axis, SumR<MeanType>{true}); }
+	Tensor_<MeanType> norm(size_t axis) const { return reduce(axis, NormR()); } // L2
+	Tensor_ max (size_t axis) const { return reduce(axis, ExtremeR<true>());  }
+	Tensor_ min (size_t axis) const { return reduce(axis, ExtremeR<false>()); }
+	Tensor_<int> argmax(size_t axis) const { return reduce(axis, ArgR<true>());  }
+	Tensor_<int> argmin(size_t axis) const { return reduce(axis, ArgR<false>()); }
+
 public: // Methods
 	Tensor_ &rand(T start=0, T end=1) {
 		
-		if (N==0) {
-			*data = (double(std::rand()%(1<<20))/(1<<20))*(end-start)+start;
-		} else { // room for improvement later, maybe
-			for (size_t i=0; i<dims[0]; i++) 
-				(*this)(i).rand();
-		}
+		forEachRun(*this, *this, [&](T *p, T *, size_t n, int64_t s, int64_t){
+			for (size_t i=0; i<n; i++, p+=s) *p = (double(std::rand()%(1<<20))/(1<<20))*(end-start)+start;
+		});
 		return *this;
 	}
 
@@ -301,181 +1066,296 @@ public: // Methods
 		if (t.storage.get() == storage.get()) return *this = t.clone(); // What about T = T.t() ??
 
 		Assert(t.N == N) << "dimensions do not match in assignment " << N << " " << t.N;
+		for (size_t d=0; d<N; d++)
+			Assert(t.dims[d] == dims[d]) << "dimensions do not match in assignment " << d << " " << dims[d] << " " << t.dims[d];
 		
-		if (N==0) {
-			*data = *t.data;
-		} else { // room for improvement later, maybe
-			
-			Assert(t.dims[0] == dims[0]) << "dimensions do not match in assignment " << N << " " << dims[0] << " " << t.dims[0];
-			for (size_t i=0; i<dims[0]; i++) 
-				(*this)(i) = t(i);
-		}
+		forEachRun(*this, t, [](T *pa, const T *pb, size_t n, int64_t sa, int64_t sb){
+			if (sa==1 and sb==1) std::copy(pb, pb+n, pa);
+			else for (size_t i=0; i<n; i++, pa+=sa, pb+=sb) *pa = *pb;
+		});
 		return *this;
 	}
 	
 	Tensor_ &operator=(const T v) && {
 		
-		if (N==0) {
-			*data = v;
-		} else { // room for improvement later, maybe
-			for (size_t i=0; i<dims[0]; i++) 
-				(*this)(i) = v;
-		}
+		forEachRun(*this, *this, [v](T *p, T *, size_t n, int64_t s, int64_t){
+			if (s==1) std::fill(p, p+n, v);
+			else for (size_t i=0; i<n; i++, p+=s) *p = v;
+		});
 		return *this;
 	}
 
+	// Elementwise expressions, see TensorExpr. Operands overlapping this tensor with a different layout are evaluated first.
+	template<typename E, typename = typename std::enable_if<TensorExpr::isExpr<E>::value and not std::is_same<E, Tensor_>::value>::type>
+	Tensor_ &operator=(const E &e) && { return evaluate(e, [](T &o, Compute v){ o = v; }); }
+
+	template<typename E, typename = TensorExpr::EnableBinary<E, Tensor_>> Tensor_ &operator+=(const E &e) { return evaluate(e, [](T &o, Compute v){ o = T(o + v); }); }
+	template<typename E, typename = TensorExpr::EnableBinary<E, Tensor_>> Tensor_ &operator-=(const E &e) { return evaluate(e, [](T &o, Compute v){ o = T(o - v); }); }
+	template<typename E, typename = TensorExpr::EnableBinary<E, Tensor_>> Tensor_ &operator*=(const E &e) { return evaluate(e, [](T &o, Compute v){ o = T(o * v); }); }
+	template<typename E, typename = TensorExpr::EnableBinary<E, Tensor_>> Tensor_ &operator/=(const E &e) { return evaluate(e, [](T &o, Compute v){ o = T(o / v); }); }
+
 	std::vector<size_t> dimensions() const { return std::vector<size_t>(dims, dims+N); }
 
-/*
-	static std::string exec(std::string command, std::string in) {
-
-		constexpr size_t CS = 1<<10;
-		
-		int linkA[2], linkB[2];
-		Assert(pipe(linkA)!=-1) << "Error creating pipe 1";
-		Assert(pipe(linkB)!=-1) << "Error creating pipe 2";
-		pid_t pid;
-		Assert((pid=fork()) !=-1) << "Error forking";
-		if (pid==0) {
-			dup2 (linkA[0], STDIN_FILENO);
-			close(linkA[1]);
-			dup2 (linkB[1], STDOUT_FILENO);
-  			close(linkB[0]);
-			execl("/bin/bash", "bash", "-c", command.c_str(), (char*)0);
-			Assert(false) << "execl failed";
-		}
-		Log(0) << "Payload delivering";
-		close(linkA[0]);
-		close(linkB[1]);
+	// NumPy style type string, e.g. "<f4". NumPy has no bfloat16, those load as raw 2 byte values.
+	static std::string dtype() { 
+		if (std::is_same<T, BFloat16>::value) return "<V2";
+		return std::string(sizeof(T)==1 ? "|" : "<") + (isFloat<T>::value ? 'f' : std::is_signed<T>::value ? 'i' : 'u') + std::to_string(sizeof(T)); 
+	}
+
+public: // Memory mapped files
 
-		for (size_t i=0; i<in.size(); i += CS) { Log(-2) << write(linkA[1], &in[i], std::min(in.size()-i, CS)); fsync(linkA[1]); }
-		close(linkA[1]);
+	// A mapped file holds a small header followed by the elements in row-major order:
+	// "uSTensor", uint32 header size, char[4] dtype, uint32 N, N x uint64 dims, zero padded to a multiple of 64 bytes.
+	
+	static size_t headerSize(size_t n) { return (8+4+4+4+8*n+63)/64*64; }
+
+	// Maps an existing file. Pages are loaded lazily. Unless writable, the map is private and changes never reach the file.
+	static Tensor_ mapFile(const std::string &filename, bool writable = false) {
 		
-		Log(0) << "Payload delivered";
+		std::ifstream in(filename, std::ios::binary);
+		Assert(in.good()) << "could not open " << filename;
+		char magic[8], type[4];
+		uint32_t hSize, n;
+		in.read(magic, 8).read((char *)&hSize, 4).read(type, 4).read((char *)&n, 4);
+		Assert(in.good() and std::string(magic, 8)=="uSTensor") << filename << " is not a mapped tensor file";
+		Assert(std::string(type, strnlen(type, 4))==dtype()) << filename << " holds " << std::string(type, strnlen(type, 4)) << " elements, not " << dtype();
+		std::vector<size_t> dimensions(n);
+		for (auto &d : dimensions) { uint64_t v=0; in.read((char *)&v, 8); d = v; }
+		Assert(in.good() and n>0 and hSize==headerSize(n)) << filename << " has a corrupt header";
 		
-		std::string out;
-		while (true) {
-			out.resize(out.size()+CS);
-			ssize_t r = read(linkB[0], &out[out.size()-CS], CS);
-			Assert(r!=-1) << "buff...";
-			out.resize(out.size()-CS+r);
-			if (r<CS) break;
+		size_t nElem = 1;
+		for (auto d : dimensions) nElem *= d;
+		return Tensor_(dimensions, mapStorage(filename, hSize, hSize + nElem*sizeof(T), writable));
+	}
+
+	// Creates (or truncates) a file and maps it writable; the elements are zero.
+	static Tensor_ mapNew(const std::string &filename, const std::vector<size_t> dimensions) {
+		
+		Assert(not dimensions.empty()) << "called with dimension zero";
+		size_t nElem = 1;
+		for (auto d : dimensions) nElem *= d;
+		Assert(nElem) << "null allocation";
+		
+		uint32_t hSize = headerSize(dimensions.size()), n = dimensions.size();
+		std::string header(hSize, 0), type = dtype();
+		memcpy(&header[0], "uSTensor", 8);
+		memcpy(&header[8], &hSize, 4);
+		memcpy(&header[12], type.data(), std::min(type.size(), size_t(4)));
+		memcpy(&header[16], &n, 4);
+		for (size_t i=0; i<n; i++) { uint64_t v = dimensions[i]; memcpy(&header[20+8*i], &v, 8); }
+		
+		{
+			std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+			Assert(out.write(header.data(), header.size()).good()) << "could not write " << filename;
 		}
-		wait(NULL);
-		return out;
+		Assert(truncate(filename.c_str(), hSize + nElem*sizeof(T))==0) << "could not resize " << filename << ": " << strerror(errno);
+		return Tensor_(dimensions, mapStorage(filename, hSize, hSize + nElem*sizeof(T), true));
 	}
 
-	std::string toTorchPipes() const {
+	// Writes this tensor to a new mapped file, and returns the mapped copy
+	Tensor_ saveMapped(const std::string &filename) const { Tensor_ t = mapNew(filename, dimensions()); t.view() = *this; return t; }
 
-		Assert(N) << "empty matrix";
-	
-		// Should be lock protected
-		
-		std::string command(R"(th -e "dims={} for i=1,io.read('*n') do dims[i]=io.read('*n') end D=torch.FloatTensor(unpack(dims)) D:apply(function() return io.read('*n') end) io.write(torch.serialize(D)) " )");
-		
-		constexpr size_t CS = 1<<20;
-		
-		int linkA[2], linkB[2];
-		Assert(pipe(linkA)!=-1) << "Error creating pipe 1";
-		Assert(pipe(linkB)!=-1) << "Error creating pipe 2";
-		pid_t pid;
-		Assert((pid=fork()) !=-1) << "Error forking";
-		if (pid==0) {
-			dup2 (linkA[0], STDIN_FILENO);
-			close(linkA[1]);
-			dup2 (linkB[1], STDOUT_FILENO);
-  			close(linkB[0]);
-			execl("/bin/bash", "bash", "-c", command.c_str(), (char*)0);
-			Assert(false) << "execl failed";
-		}
+protected:
+
+	static std::shared_ptr<Storage> mapStorage(const std::string &filename, size_t offset, size_t size, bool writable) {
+		
+		int fd = open(filename.c_str(), writable ? O_RDWR : O_RDONLY);
+		Assert(fd>=0) << "could not open " << filename << ": " << strerror(errno);
+		struct stat st;
+		bool ok = (fstat(fd, &st)==0 and size_t(st.st_size)>=size);
+		void *map = ok ? mmap(nullptr, size, PROT_READ | PROT_WRITE, writable ? MAP_SHARED : MAP_PRIVATE, fd, 0) : MAP_FAILED;
+		int err = errno;
+		close(fd);
+		Assert(ok) << filename << " is shorter than its header claims";
+		Assert(map!=MAP_FAILED) << "could not map " << filename << ": " << strerror(err);
+		return std::make_shared<Storage>(map, size, offset);
+	}
 
-		Log(-2) << "Delivering payload";
-		close(linkA[0]);
-		close(linkB[1]);
+public: // NumPy and HDF5 files
 
-		char s[100]; 
-		snprintf(s, 100, "%zu\n", N); write(linkA[1], s, strlen(s));
-		for (size_t i=0; i<N; i++) { snprintf(s, 100, "%zu\n", dims[i]); write(linkA[1], s, strlen(s)); }
-		for (const auto &v : this->clone()) { snprintf(s, 100, "%.9f\n", float(v)); write(linkA[1], s, strlen(s)); }
-		close(linkA[1]);
+	// Streams the elements in row-major order. Views that are not continuous are gathered through a small buffer.
+	void writeElements(std::ostream &os) const {
 		
-		Log(-2) << "Payload delivered";
+		if (isContinuous()) { os.write((const char *)data, nElem()*sizeof(T)); return; }
+		std::vector<T> buf;
+		buf.reserve(1<<18);
+		forEachRun(*this, *this, [&](T *p, T *, size_t n, int64_t s, int64_t){
+			for (size_t i=0; i<n; i++, p+=s) {
+				buf.push_back(*p);
+				if (buf.size()==buf.capacity()) { os.write((const char *)buf.data(), buf.size()*sizeof(T)); buf.clear(); }
+			}
+		});
+		os.write((const char *)buf.data(), buf.size()*sizeof(T));
+	}
+
+	// .npy version 1.0: magic, header length, then a Python dict padded with spaces so the data starts 64 byte aligned
+	std::string npyHeader() const {
 		
-		std::string out;
-		while (true) {
-			out.resize(out.size()+CS);
-			ssize_t r = read(linkB[0], &out[out.size()-CS], CS);
-			Assert(r!=-1) << "buff...";
-			out.resize(out.size()-CS+r);
-			if (r<CS) break;
-		}
-		wait(NULL);
-		return out;
+		std::ostringstream oss;
+		oss << "{'descr': '" << dtype() << "', 'fortran_order': False, 'shape': (";
+		for (size_t i=0; i<N; i++) oss << (i?", ":"") << dims[i];
+		oss << (N==1?",), }":"), }");
+		std::string dict = oss.str();
+		dict.resize((10+dict.size()+1+63)/64*64-10-1, ' ');
+		dict += '\n';
+		uint16_t len = dict.size();
+		return std::string("\x93NUMPY\x01\x00", 8) + std::string((const char *)&len, 2) + dict;
 	}
-	
-	std::string toTorch() && { // Limited to around 1GB only
-	
-		Assert(N) << "empty matrix";
-		Assert(isContinuous()) << "matrix is not continuous";
+
+	void saveNpy(std::ostream &os) const { std::string h = npyHeader(); os.write(h.data(), h.size()); writeElements(os); }
+	void saveNpy(const std::string &filename) const { 
+		std::ofstream out(filename, std::ios::binary); 
+		saveNpy(out); 
+		Assert(out.good()) << "could not write " << filename; 
+	}
+
+	static Tensor_ loadNpy(std::istream &is) {
 		
-		std::string fileName = std::tmpnam(nullptr);
-		std::ofstream(fileName).write((char *)storage->data, nElem()*sizeof(T));
-		storage.reset();
+		std::vector<size_t> shape;
+		bool fortran = parseNpyHeader(is, shape);
+		if (fortran) std::reverse(shape.begin(), shape.end()); // the data is stored with the last axis outermost
+		Tensor_ t(shape.empty() ? std::vector<size_t>(1, 1) : shape);
+		Assert(is.read((char *)t.data, t.nElem()*sizeof(T)).good()) << "truncated .npy data";
+		return fortran ? t.reversed() : t;
+	}
+	static Tensor_ loadNpy(const std::string &filename) { std::ifstream in(filename, std::ios::binary); Assert(in.good()) << "could not open " << filename; return loadNpy(in); }
+
+	// Maps the data of a .npy file in place, see mapFile
+	static Tensor_ mapNpy(const std::string &filename, bool writable = false) {
 		
-//		std::string command(R"(th -e "D=torch.FloatTensor(") D:apply(function() return io.read('*n') end) io.write(torch.serialize(D)) " )");
+		std::ifstream in(filename, std::ios::binary);
+		Assert(in.good()) << "could not open " << filename;
+		std::vector<size_t> shape;
+		bool fortran = parseNpyHeader(in, shape);
+		return mapAt(filename, in.tellg(), shape, fortran, writable);
+	}
+
+	// Reads array name from a .npz archive. Stored entries (np.savez) are mapped in place, compressed ones are inflated.
+	static Tensor_ loadNpz(const std::string &filename, const std::string &name) {
 		
-		std::ostringstream oss; oss << "th -e \"D=torch.FloatTensor(";
-		for (size_t i=0; i<N; i++) oss << (i?",":"") << dims[i];
-		oss << ") torch.DiskFile('" << fileName<< "','r'):binary():readFloat(D:storage()) ";
-		oss << " io.write(torch.serialize(D))\"";
-		std::string command = oss.str();
-		
-		Log(0) << command;
-		
-		constexpr size_t CS = 1<<20;
-		
-		int linkB[2];
-		Assert(pipe(linkB)!=-1) << "Error creating pipe 2";
-		pid_t pid;
-		Assert((pid=fork()) !=-1) << "Error forking";
-		if (pid==0) {
-			dup2 (linkB[1], STDOUT_FILENO);
-  			close(linkB[0]);
-			execl("/bin/bash", "bash", "-c", command.c_str(), (char*)0);
-			Assert(false) << "execl failed";
+		std::ifstream in(filename, std::ios::binary);
+		Assert(in.good()) << "could not open " << filename;
+		uint64_t offset, size;
+		int method = findZipEntry(in, name + ".npy", offset, size);
+		Assert(method==0 or method==8) << "unsupported compression in " << filename;
+		in.seekg(offset);
+		
+		if (method==0) {
+			std::vector<size_t> shape;
+			bool fortran = parseNpyHeader(in, shape);
+			if (size_t(in.tellg())%sizeof(T)==0) return mapAt(filename, in.tellg(), shape, fortran, false);
+			in.seekg(offset); // np.savez does not align its entries
+			return loadNpy(in);
+		}
+		
+		std::string packed(size, 0), npy;
+		in.read(&packed[0], size);
+		z_stream z = z_stream();
+		Assert(inflateInit2(&z, -MAX_WBITS)==Z_OK) << "inflateInit failed";
+		z.next_in = (Bytef *)&packed[0];
+		z.avail_in = packed.size();
+		int ret = Z_OK;
+		while (ret==Z_OK) {
+			char buf[1<<16];
+			z.next_out = (Bytef *)buf;
+			z.avail_out = sizeof(buf);
+			ret = inflate(&z, Z_NO_FLUSH);
+			npy.append(buf, sizeof(buf)-z.avail_out);
 		}
+		inflateEnd(&z);
+		Assert(ret==Z_STREAM_END) << "corrupt entry " << name << " in " << filename;
+		std::istringstream iss(npy);
+		return loadNpy(iss);
+	}
 
-		Log(-2) << "Delivering payload";
-		close(linkB[1]);
+	// Writes a file with a single contiguous dataset at the root, readable by the HDF5 library (h5py, torch-hdf5, ...)
+	void saveHDF5(std::ostream &os, std::string dataset) const {
 		
-		Log(-2) << "Payload delivered";
+		if (not dataset.empty() and dataset[0]=='/') dataset = dataset.substr(1);
+		Assert(not dataset.empty() and dataset.find('/')==std::string::npos) << "only datasets at the root are supported: " << dataset;
 		
-		std::string out;
-		while (true) {
-			out.resize(out.size()+CS);
-			ssize_t r = read(linkB[0], &out[out.size()-CS], CS);
-			Assert(r!=-1) << "buff...";
-			out.resize(out.size()-CS+r);
-			if (r<CS) break;
+		const uint64_t UNDEF = ~uint64_t(0);
+		std::string f;
+		auto put = [&f](uint64_t v, size_t bytes) { for (size_t i=0; i<bytes; i++) f += char(v>>(8*i)); };
+		auto pad = [&f](size_t align) { f.resize((f.size()+align-1)/align*align, 0); };
+		auto message = [&](uint16_t type, const std::string &body) { put(type, 2); put((body.size()+7)/8*8, 2); put(0, 4); f += body; pad(8); };
+		auto le = [](uint64_t v, size_t bytes) { std::string s; for (size_t i=0; i<bytes; i++) s += char(v>>(8*i)); return s; };
+		
+		// addresses
+		size_t nameSize = (dataset.size()+1+7)/8*8, heapSize = 8 + nameSize + 16;
+		uint64_t rootHeader = 96, heap = rootHeader+40, heapData = heap+32, btree = heapData+heapSize, snod = btree+544, header = snod+328;
+		uint64_t bytes = nElem()*sizeof(T);
+		
+		std::string space = le(1,1) + le(N,1) + le(0,6);
+		for (size_t i=0; i<N; i++) space += le(dims[i], 8);
+		std::string type;
+		if (isFloat<T>::value) {
+			size_t bits = 8*sizeof(T), mantissa = std::is_same<T, BFloat16>::value ? 7 : bits==16 ? 10 : bits==32 ? 23 : 52, exponent = bits-1-mantissa;
+			type = le(0x11,1) + le(0x20,1) + le(bits-1,1) + le(0,1) + le(sizeof(T),4) + le(0,2) + le(bits,2)
+			     + le(mantissa,1) + le(exponent,1) + le(0,1) + le(mantissa,1) + le((1<<(exponent-1))-1,4);
+		} else {
+			type = le(0x10,1) + le(std::is_signed<T>::value?8:0,1) + le(0,2) + le(sizeof(T),4) + le(0,2) + le(8*sizeof(T),2);
 		}
-		close(linkB[0]);
-		wait(NULL);
-		return out;
-	}*/
+		std::string fill = le(2,1) + le(1,1) + le(2,1) + le(0,1);
+		uint64_t headerSize = 16 + (8+(space.size()+7)/8*8) + (8+(type.size()+7)/8*8) + (8+8) + (8+24);
+		uint64_t address = (header+headerSize+63)/64*64;
+		std::string layout = le(3,1) + le(1,1) + le(address,8) + le(bytes,8);
+		
+		// superblock version 0 with the root group symbol table entry
+		f += std::string("\x89HDF\r\n\x1a\n", 8);
+		put(0,5); put(8,1); put(8,1); put(0,1); put(4,2); put(16,2); put(0,4);
+		put(0,8); put(UNDEF,8); put(address+bytes,8); put(UNDEF,8);
+		put(0,8); put(rootHeader,8); put(1,4); put(0,4); put(btree,8); put(heap,8);
+		
+		// root group: object header with a symbol table message, local heap with the names, B-tree and one symbol table node
+		put(1,1); put(0,1); put(1,2); put(1,4); put(24,4); put(0,4);
+		message(0x11, le(btree,8) + le(heap,8));
+		f += "HEAP"; put(0,4); put(heapSize,8); put(8+nameSize,8); put(heapData,8);
+		put(0,8); f += dataset; pad(8); put(1,8); put(16,8);
+		f += "TREE"; put(0,1); put(0,1); put(1,2); put(UNDEF,8); put(UNDEF,8); put(0,8); put(snod,8); put(8,8); f.resize(snod, 0);
+		f += "SNOD"; put(1,1); put(0,1); put(1,2); put(8,8); put(header,8); put(0,4); put(0,4); put(0,16); f.resize(header, 0);
+		
+		// dataset: dataspace, datatype, fill value and contiguous layout
+		put(1,1); put(0,1); put(4,2); put(1,4); put(headerSize-16,4); put(0,4);
+		message(0x01, space);
+		message(0x03, type);
+		message(0x05, fill);
+		message(0x08, layout);
+		f.resize(address, 0);
+		
+		os.write(f.data(), f.size());
+		writeElements(os);
+	}
+	void saveHDF5(const std::string &filename, const std::string &dataset) const { 
+		std::ofstream out(filename, std::ios::binary); 
+		saveHDF5(out, dataset); 
+		Assert(out.good()) << "could not write " << filename; 
+	}
 	
+	// Writes natively a dataset at the root of a new or truncated ("w") file. Adding to an existing file ("a", "r+")
+	// or writing nested paths still goes through torch-hdf5.
 	void toTorchHDF5(std::string fileNameH5, std::string tensorPath, std::string accessMode="a") && {
 	
 		Assert(N) << "empty matrix";
-		Assert(isContinuous()) << "matrix is not continuous";
+		std::string name = (not tensorPath.empty() and tensorPath[0]=='/') ? tensorPath.substr(1) : tensorPath;
+		bool atRoot = not name.empty() and name.find('/')==std::string::npos;
+		if (atRoot and (accessMode=="w" or not std::ifstream(fileNameH5).good())) return saveHDF5(fileNameH5, tensorPath);
 
-		// Todo: move to mkstemp
-		std::string fileName = std::tmpnam(nullptr);
-		std::ofstream(fileName).write((char *)storage->data, nElem()*sizeof(T));
+		// torch7 type matching T, as "DoubleTensor" and DiskFile:readDouble
+		std::map<std::string, std::string> torchTypes{{"<f8","Double"}, {"<f4","Float"}, {"<i8","Long"}, {"<i4","Int"}, {"<i2","Short"}, {"|i1","Char"}, {"|u1","Byte"}};
+		Assert(torchTypes.count(dtype())) << "torch has no tensor type for " << dtype() << " elements";
+		const std::string &torchType = torchTypes[dtype()];
+
+		char fileName[] = "/tmp/tensorXXXXXX";
+		int fd = mkstemp(fileName);
+		Assert(fd>=0) << "could not create a temporary file: " << strerror(errno);
+		close(fd);
+		{ std::ofstream out(fileName, std::ios::binary); writeElements(out); }
 		storage.reset();
 		
-		std::ostringstream oss; oss << "th -e \"D=torch.FloatTensor(";
+		std::ostringstream oss; oss << "th -e \"D=torch." << torchType << "Tensor(";
 		for (size_t i=0; i<N; i++) oss << (i?",":"") << dims[i];
-		oss << ") torch.DiskFile('" << fileName<< "','r'):binary():readFloat(D:storage()) ";
+		oss << ") torch.DiskFile('" << fileName<< "','r'):binary():read" << torchType << "(D:storage()) ";
 		oss << " os.execute('rm " << fileName << "');";
 		oss << " require 'hdf5';";
 		oss << " hdf5.open('" << fileNameH5 << "', '"<< accessMode <<"'):write('" << tensorPath << "', D)\"";
@@ -484,8 +1364,325 @@ public: // Methods
 		
 		Log(0) << system(oss.str().c_str());
 	}
+
+protected:
+
+	// Same as the dims reversed, and the strides with them: the layout of a Fortran ordered array
+	Tensor_ reversed() const {
+		Tensor_ t = const_cast<Tensor_ &>(*this);
+		std::reverse(t.dims, t.dims+N);
+		std::reverse(t.stride0, t.stride0+N);
+		std::reverse(t.stride1, t.stride1+N);
+		return t;
+	}
+
+	static Tensor_ mapAt(const std::string &filename, size_t offset, std::vector<size_t> shape, bool fortran, bool writable) {
+		
+		if (shape.empty()) shape.push_back(1);
+		size_t nElem = 1;
+		for (auto d : shape) nElem *= d;
+		Assert(nElem) << "null allocation";
+		Assert(offset%sizeof(T)==0) << "misaligned data in " << filename;
+		if (fortran) std::reverse(shape.begin(), shape.end());
+		Tensor_ t(shape, mapStorage(filename, offset, offset + nElem*sizeof(T), writable));
+		return fortran ? t.reversed() : t;
+	}
+
+	// Returns whether the array is in Fortran order, leaves the stream at the data
+	static bool parseNpyHeader(std::istream &is, std::vector<size_t> &shape) {
+		
+		char magic[8];
+		Assert(is.read(magic, 8).good() and std::string(magic, 6)=="\x93NUMPY") << "not a .npy stream";
+		uint32_t len = 0;
+		is.read((char *)&len, magic[6]==1 ? 2 : 4);
+		std::string dict(len, 0);
+		Assert(is.read(&dict[0], len).good()) << "truncated .npy header";
+		
+		auto value = [&](const std::string &key) { 
+			size_t p = dict.find("'" + key + "'");
+			Assert(p!=std::string::npos) << ".npy header without " << key;
+			return dict.substr(dict.find(':', p)+1); 
+		};
+		std::string descr = value("descr");
+		descr = descr.substr(descr.find('\'')+1);
+		descr = descr.substr(0, descr.find('\''));
+		if (descr[0]=='|' or descr[0]=='=') descr[0] = '<';
+		std::string own = dtype();
+		own[0] = '<';
+		Assert(descr==own) << ".npy holds " << descr << " elements, not " << dtype();
+		
+		std::string s = value("shape");
+		s = s.substr(s.find('(')+1, s.find(')')-s.find('(')-1);
+		std::istringstream iss(s);
+		for (std::string d; std::getline(iss, d, ',');)
+			if (d.find_first_of("0123456789")!=std::string::npos) shape.push_back(std::stoull(d));
+		return value("fortran_order").find("True") < value("fortran_order").find("False");
+	}
+
+	// Locates an entry in a zip archive, returns its compression method and leaves offset at its data
+	static int findZipEntry(std::istream &is, const std::string &name, uint64_t &offset, uint64_t &size) {
+		
+		auto get = [&is](size_t bytes) { uint64_t v = 0; for (size_t i=0; i<bytes; i++) v |= uint64_t(uint8_t(is.get()))<<(8*i); return v; };
+		
+		is.seekg(0, std::ios::end);
+		int64_t end = is.tellg(), eocd = end-22;
+		for (; eocd>=0 and eocd>=end-22-65535; eocd--) { is.seekg(eocd); if (get(4)==0x06054b50) break; }
+		Assert(eocd>=0 and eocd>=end-22-65535) << "not a zip archive";
+		is.seekg(eocd+10);
+		uint64_t entries = get(2); get(4);
+		uint64_t directory = get(4);
+		if (eocd>=20) { 
+			is.seekg(eocd-20);
+			if (get(4)==0x07064b50) { get(4); is.seekg(get(8)+32); entries = get(8); get(8); directory = get(8); }
+		}
+		
+		is.seekg(directory);
+		for (uint64_t e=0; e<entries; e++) {
+			Assert(get(4)==0x02014b50) << "corrupt zip directory";
+			get(6); 
+			int method = get(2); 
+			get(8);
+			uint64_t packed = get(4), plain = get(4), nameLen = get(2), extraLen = get(2), commentLen = get(2);
+			get(8);
+			uint64_t local = get(4);
+			std::string entry(nameLen, 0);
+			is.read(&entry[0], nameLen);
+			std::streamoff next = int64_t(is.tellg()) + extraLen + commentLen;
+			for (uint64_t x=0; x+4<=extraLen; ) {
+				uint64_t id = get(2), len = get(2);
+				if (id==1) {
+					if (plain ==0xFFFFFFFF) plain  = get(8);
+					if (packed==0xFFFFFFFF) packed = get(8);
+					if (local ==0xFFFFFFFF) local  = get(8);
+					break;
+				}
+				is.seekg(len, std::ios::cur); x += 4+len;
+			}
+			if (entry==name) {
+				is.seekg(local+26);
+				uint64_t n = get(2), m = get(2);
+				offset = local+30+n+m;
+				size = packed;
+				return method;
+			}
+			is.seekg(next);
+		}
+		Assert(false) << "no entry " << name;
+		return -1;
+	}
 };
 
-typedef Tensor_<float> Tensor1f;
+typedef Tensor_<float>    Tensor1f;
+typedef Tensor_<double>   Tensor1d;
+typedef Tensor_<Half>     Tensor1h;
+typedef Tensor_<BFloat16> Tensor1bf;
+typedef Tensor_<int>      Tensor1i;
+typedef Tensor_<int16_t>  Tensor1s;
+typedef Tensor_<uint8_t>  Tensor1b;
 
+// Streams arrays into an uncompressed .npz archive (zip64, as written by np.savez), one at a time, to any ostream
+class NpzWriter {
+	
+	struct CrcBuf : std::streambuf { // forwards to os, counting bytes and updating the CRC32
+		std::ostream &os;
+		uLong crc = crc32(0L, Z_NULL, 0);
+		uint64_t count = 0;
+		CrcBuf(std::ostream &os) : os(os) {}
+		std::streamsize xsputn(const char *s, std::streamsize n) override { 
+			for (std::streamsize done=0; done<n; done+=(1<<30)) crc = crc32(crc, (const Bytef *)s+done, std::min(n-done, std::streamsize(1<<30)));
+			count += n; 
+			os.write(s, n); 
+			return os.good() ? n : 0; 
+		}
+		int_type overflow(int_type c) override { 
+			if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+			char ch = traits_type::to_char_type(c); 
+			return xsputn(&ch, 1)==1 ? c : traits_type::eof(); 
+		}
+	};
+
+	struct Entry { std::string name; uint32_t crc; uint64_t size, offset; };
+
+	std::ofstream file;
+	std::ostream &os;
+	std::vector<Entry> entries;
+	uint64_t pos = 0;
+	bool closed = false;
+	
+	void put(uint64_t v, size_t bytes) { for (size_t i=0; i<bytes; i++) os.put(char(v>>(8*i))); pos += bytes; }
+	void put(const std::string &s) { os.write(s.data(), s.size()); pos += s.size(); }
+
+public:
+	NpzWriter(const std::string &filename) : file(filename, std::ios::binary), os(file) { Assert(file.good()) << "could not open " << filename; }
+	NpzWriter(std::ostream &os) : os(os) { std::streamoff base = os.tellp(); if (base>0) pos = base; } // zip offsets count from the start of the stream
+	~NpzWriter() { try { close(); } catch (...) {} } // call close() to see write errors
+	
+	template<typename T>
+	NpzWriter &add(const std::string &name, const Tensor_<T> &t) {
+		
+		Assert(not closed) << "archive already closed";
+		Entry e{ name + ".npy", 0, t.npyHeader().size() + t.nElem()*sizeof(T), pos };
+		put(0x04034b50,4); put(45,2); put(8,2); put(0,2); put(0,2); put(0x21,2); 
+		put(0,4); put(0xFFFFFFFF,4); put(0xFFFFFFFF,4); put(e.name.size(),2); put(20,2); put(e.name);
+		put(1,2); put(16,2); put(e.size,8); put(e.size,8);
+		
+		CrcBuf cb(os);
+		std::ostream cos(&cb);
+		t.saveNpy(cos);
+		Assert(cb.count==e.size and os.good()) << "failed writing " << name;
+		e.crc = cb.crc;
+		pos += cb.count;
+		
+		put(0x08074b50,4); put(e.crc,4); put(e.size,8); put(e.size,8);
+		entries.push_back(e);
+		return *this;
+	}
+	
+	// Writes the central directory. Throws if the archive could not be written completely.
+	void close() {
+		
+		if (closed) return;
+		closed = true;
+		uint64_t directory = pos;
+		for (auto &e : entries) {
+			put(0x02014b50,4); put(45,2); put(45,2); put(8,2); put(0,2); put(0,2); put(0x21,2);
+			put(e.crc,4); put(0xFFFFFFFF,4); put(0xFFFFFFFF,4); put(e.name.size(),2); put(28,2); put(0,2); 
+			put(0,2); put(0,2); put(0,4); put(0xFFFFFFFF,4); put(e.name);
+			put(1,2); put(24,2); put(e.size,8); put(e.size,8); put(e.offset,8);
+		}
+		uint64_t end = pos;
+		put(0x06064b50,4); put(44,8); put(45,2); put(45,2); put(0,4); put(0,4); 
+		put(entries.size(),8); put(entries.size(),8); put(end-directory,8); put(directory,8);
+		put(0x07064b50,4); put(0,4); put(end,8); put(1,4);
+		put(0x06054b50,4); put(0,2); put(0,2); put(std::min(entries.size(), size_t(0xFFFF)),2); put(std::min(entries.size(), size_t(0xFFFF)),2);
+		put(0xFFFFFFFF,4); put(0xFFFFFFFF,4); put(0,2);
+		os.flush();
+		Assert(os.good()) << "failed writing the archive directory";
+	}
+};
+
+template<typename U> 
+TensorExpr::Cursor::Cursor(const Tensor_<U> &t) : storage(t.storage), p((const char *)t.origin()), size(sizeof(U)), dims(t.dims, t.dims+t.N) {
+	for (size_t d=0; d<t.N; d++) stride.push_back(int64_t(t.stride1[d])*size);
+}
+
+// Elementwise operators and functions on tensors and expressions, mixed with plain numbers
+namespace TensorExpr {
+	struct Add { template<typename X, typename Y> auto operator()(X x, Y y) const -> decltype(x+y) { return x+y; } };
+	struct Sub { template<typename X, typename Y> auto operator()(X x, Y y) const -> decltype(x-y) { return x-y; } };
+	struct Mul { template<typename X, typename Y> auto operator()(X x, Y y) const -> decltype(x*y) { return x*y; } };
+	struct Div { template<typename X, typename Y> auto operator()(X x, Y y) const -> decltype(x/y) { return x/y; } };
+	struct Min { template<typename X, typename Y> auto operator()(X x, Y y) const -> decltype(x+y) { return y<x?y:x; } };
+	struct Max { template<typename X, typename Y> auto operator()(X x, Y y) const -> decltype(x+y) { return x<y?y:x; } };
+	struct Pow { template<typename X, typename Y> auto operator()(X x, Y y) const -> decltype(std::pow(x,y)) { return std::pow(x,y); } };
+	// comparisons yield 0/1 masks
+	struct EQ { template<typename X, typename Y> uint8_t operator()(X x, Y y) const { return x==y; } };
+	struct NE { template<typename X, typename Y> uint8_t operator()(X x, Y y) const { return x!=y; } };
+	struct LT { template<typename X, typename Y> uint8_t operator()(X x, Y y) const { return x< y; } };
+	struct LE { template<typename X, typename Y> uint8_t operator()(X x, Y y) const { return x<=y; } };
+	struct GT { template<typename X, typename Y> uint8_t operator()(X x, Y y) const { return x> y; } };
+	struct GE { template<typename X, typename Y> uint8_t operator()(X x, Y y) const { return x>=y; } };
+
+#define USNIPPETS_TENSOR_BINARY(name, F) \
+	template<typename X, typename Y, typename = EnableBinary<X,Y>> \
+	typename BinaryOf<F, X, Y>::type name(const X &x, const Y &y) { return BinaryOf<F, X, Y>::make(x, y); }
+
+	USNIPPETS_TENSOR_BINARY(operator+,  Add)
+	USNIPPETS_TENSOR_BINARY(operator-,  Sub)
+	USNIPPETS_TENSOR_BINARY(operator*,  Mul)
+	USNIPPETS_TENSOR_BINARY(operator/,  Div)
+	USNIPPETS_TENSOR_BINARY(operator==, EQ)
+	USNIPPETS_TENSOR_BINARY(operator!=, NE)
+	USNIPPETS_TENSOR_BINARY(operator<,  LT)
+	USNIPPETS_TENSOR_BINARY(operator<=, LE)
+	USNIPPETS_TENSOR_BINARY(operator>,  GT)
+	USNIPPETS_TENSOR_BINARY(operator>=, GE)
+	USNIPPETS_TENSOR_BINARY(minimum,    Min)
+	USNIPPETS_TENSOR_BINARY(maximum,    Max)
+	USNIPPETS_TENSOR_BINARY(pow,        Pow)
+#undef USNIPPETS_TENSOR_BINARY
+
+	// apply(x, f) maps any callable over the elements of x
+	template<typename X, typename F, typename = EnableUnary<X>>
+	Unary<F, typename Operand<X>::type> apply(const X &x, F f) { return Unary<F, typename Operand<X>::type>(f, Operand<X>::make(x)); }
+
+	struct Neg   { template<typename X> auto operator()(X x) const -> decltype(-x)            { return -x;            } };
+	struct Abs   { template<typename X> auto operator()(X x) const -> decltype(std::abs(x))   { return std::abs(x);   } };
+	struct Sqrt  { template<typename X> auto operator()(X x) const -> decltype(std::sqrt(x))  { return std::sqrt(x);  } };
+	struct Exp   { template<typename X> auto operator()(X x) const -> decltype(std::exp(x))   { return std::exp(x);   } };
+	struct Log   { template<typename X> auto operator()(X x) const -> decltype(std::log(x))   { return std::log(x);   } };
+	struct Sin   { template<typename X> auto operator()(X x) const -> decltype(std::sin(x))   { return std::sin(x);   } };
+	struct Cos   { template<typename X> auto operator()(X x) const -> decltype(std::cos(x))   { return std::cos(x);   } };
+	struct Tanh  { template<typename X> auto operator()(X x) const -> decltype(std::tanh(x))  { return std::tanh(x);  } };
+	struct Floor { template<typename X> auto operator()(X x) const -> decltype(std::floor(x)) { return std::floor(x); } };
+	struct Ceil  { template<typename X> auto operator()(X x) const -> decltype(std::ceil(x))  { return std::ceil(x);  } };
+
+#define USNIPPETS_TENSOR_UNARY(name, F) \
+	template<typename X, typename = EnableUnary<X>> \
+	Unary<F, typename Operand<X>::type> name(const X &x) { return apply(x, F()); }
+
+	USNIPPETS_TENSOR_UNARY(operator-, Neg)
+	USNIPPETS_TENSOR_UNARY(abs,       Abs)
+	USNIPPETS_TENSOR_UNARY(sqrt,      Sqrt)
+	USNIPPETS_TENSOR_UNARY(exp,       Exp)
+	USNIPPETS_TENSOR_UNARY(log,       Log)
+	USNIPPETS_TENSOR_UNARY(sin,       Sin)
+	USNIPPETS_TENSOR_UNARY(cos,       Cos)
+	USNIPPETS_TENSOR_UNARY(tanh,      Tanh)
+	USNIPPETS_TENSOR_UNARY(floor,     Floor)
+	USNIPPETS_TENSOR_UNARY(ceil,      Ceil)
+#undef USNIPPETS_TENSOR_UNARY
+}
+
+}
+
+// Let OpenCV and the standard library know about the 16 bit element types
+namespace cv {
+template<> class DataType<uSnippets::Half> {
+public:
+	typedef uSnippets::Half value_type;
+	typedef float work_type;
+	typedef value_type channel_type;
+	typedef value_type vec_type;
+#ifdef CV_16F
+	enum { generic_type = 0, depth = CV_16F, channels = 1, fmt = (int)'h', type = CV_MAKETYPE(depth, channels) };
+#else
+	enum { generic_type = 0, depth = CV_16U, channels = 1, fmt = (int)'w', type = CV_MAKETYPE(depth, channels) };
+#endif
+};
+
+template<> class DataType<uSnippets::BFloat16> { // OpenCV has no bfloat16 depth, it sees the raw bits
+public:
+	typedef uSnippets::BFloat16 value_type;
+	typedef float work_type;
+	typedef value_type channel_type;
+	typedef value_type vec_type;
+	enum { generic_type = 0, depth = CV_16U, channels = 1, fmt = (int)'w', type = CV_MAKETYPE(depth, channels) };
+};
+}
+
+namespace std {
+template<> struct numeric_limits<uSnippets::Half> : numeric_limits<float> {
+	static constexpr int digits = 11, digits10 = 3, max_digits10 = 5, min_exponent = -13, min_exponent10 = -4, max_exponent = 16, max_exponent10 = 4;
+	static uSnippets::Half min()        { return uSnippets::Half::fromBits(0x0400); }
+	static uSnippets::Half max()        { return uSnippets::Half::fromBits(0x7bff); }
+	static uSnippets::Half lowest()     { return uSnippets::Half::fromBits(0xfbff); }
+	static uSnippets::Half epsilon()    { return uSnippets::Half::fromBits(0x1400); }
+	static uSnippets::Half round_error(){ return uSnippets::Half::fromBits(0x3800); }
+	static uSnippets::Half infinity()   { return uSnippets::Half::fromBits(0x7c00); }
+	static uSnippets::Half quiet_NaN()  { return uSnippets::Half::fromBits(0x7e00); }
+	static uSnippets::Half denorm_min() { return uSnippets::Half::fromBits(0x0001); }
+};
+
+template<> struct numeric_limits<uSnippets::BFloat16> : numeric_limits<float> {
+	static constexpr int digits = 8, digits10 = 2, max_digits10 = 4;
+	static uSnippets::BFloat16 min()        { return uSnippets::BFloat16::fromBits(0x0080); }
+	static uSnippets::BFloat16 max()        { return uSnippets::BFloat16::fromBits(0x7f7f); }
+	static uSnippets::BFloat16 lowest()     { return uSnippets::BFloat16::fromBits(0xff7f); }
+	static uSnippets::BFloat16 epsilon()    { return uSnippets::BFloat16::fromBits(0x3c00); }
+	static uSnippets::BFloat16 round_error(){ return uSnippets::BFloat16::fromBits(0x3f00); }
+	static uSnippets::BFloat16 infinity()   { return uSnippets::BFloat16::fromBits(0x7f80); }
+	static uSnippets::BFloat16 quiet_NaN()  { return uSnippets::BFloat16::fromBits(0x7fc0); }
+	static uSnippets::BFloat16 denorm_min() { return uSnippets::BFloat16::fromBits(0x0001); }
+};
 }